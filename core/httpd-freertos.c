@@ -21,12 +21,120 @@ Platform-dependent routines, FreeRTOS version
 #include "freertos/queue.h"
 #include "freertos/semphr.h"
 
+#include <fcntl.h>
+#include <errno.h>
+
 #define fr_of_instance(instance) esp_container_of(instance, HttpdFreertosInstance, httpdInstance)
 #define frconn_of_conn(conn) esp_container_of(conn, RtosConnType, connData)
 
+// a call queued with httpdPlatPost()
+typedef struct
+{
+    HttpdPlatPostFn fn;
+    void *arg;
+} PlatPostedCall;
+
 
 const static char* TAG = "httpd-freertos";
 
+#ifdef CONFIG_ESPHTTPD_SSL_SUPPORT
+/**
+ * SSL_write() all of buff, the library may take it a record at a time
+ * Returns len, or -1 when the connection failed or took nothing for HTTPD_SEND_TIMEOUT_MS
+ */
+static int MEM_ATTR platSslWrite(RtosConnType *pRconn, const char *buff, int len) {
+    int bytesWritten = 0;
+    while (bytesWritten < len) {
+        int r = SSL_write(pRconn->ssl, buff + bytesWritten, len - bytesWritten);
+        if (r <= 0) {
+            ESP_LOGE(TAG, "SSL_write failed after %d of %d bytes, error %d", bytesWritten, len, SSL_get_error(pRconn->ssl, r));
+            return -1;
+        }
+        bytesWritten += r;
+    }
+    return bytesWritten;
+}
+
+/**
+ * Write out the coalesced data as a single TLS record
+ * Returns 0 on success, -1 when the write failed
+ */
+static int MEM_ATTR platSslFlushCoalesced(RtosConnType *pRconn) {
+    if (pRconn->coalesceLen == 0) { return 0; }
+
+    int coalesceLen = pRconn->coalesceLen;
+    pRconn->coalesceLen = 0;
+    if (platSslWrite(pRconn, pRconn->coalesceBuf, coalesceLen) != coalesceLen) {
+        ESP_LOGE(TAG, "write of %d coalesced bytes failed", coalesceLen);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Hold a small write back so it can share a TLS record with the ones that follow.
+ * Anything already held is written first when the new data doesn't fit, which keeps the ordering.
+ */
+static int MEM_ATTR platSslCoalesce(HttpdFreertosInstance *pFR, RtosConnType *pRconn, char *buff, int len) {
+    int coalesceSize = pFR->sslConfig.coalesceSize;
+
+    if (pRconn->coalesceLen + len > coalesceSize) {
+        if (platSslFlushCoalesced(pRconn) != 0) { return -1; }
+    }
+
+    if (len >= coalesceSize) {
+        return platSslWrite(pRconn, buff, len);
+    }
+
+    if (!pRconn->coalesceBuf) {
+        pRconn->coalesceBuf = malloc(coalesceSize);
+        if (!pRconn->coalesceBuf) {
+            ESP_LOGW(TAG, "no memory for write coalescing, writing directly");
+            return platSslWrite(pRconn, buff, len);
+        }
+    }
+
+    if (pRconn->coalesceLen == 0) {
+        pRconn->coalesceDeadline = xTaskGetTickCount() + pdMS_TO_TICKS(pFR->sslConfig.coalesceDelayMs);
+        // the server task may be sleeping in select() without this deadline
+        httpdPlatWake(&pFR->httpdInstance);
+    }
+    memcpy(&pRconn->coalesceBuf[pRconn->coalesceLen], buff, len);
+    pRconn->coalesceLen += len;
+
+    return len;
+}
+#endif
+
+/**
+ * Write all of iov, which is used as scratch space. Client sockets have a send timeout of
+ * HTTPD_SEND_TIMEOUT_MS, so a peer that takes nothing for that long fails the write instead
+ * of holding the server task until TCP gives up on it.
+ * Returns the number of bytes written, or -1 on error
+ */
+static int MEM_ATTR platWritevAll(RtosConnType *pRconn, struct iovec *pIov, int iovcnt) {
+    int bytesWritten = 0;
+    while (iovcnt > 0) {
+        // writev() returns what went out before the timeout, keep going from where it stopped
+        int r = writev(pRconn->fd, pIov, iovcnt);
+        if (r < 0) {
+            ESP_LOGE(TAG, "writev failed after %d bytes, errno %d", bytesWritten, errno);
+            return -1;
+        }
+        bytesWritten += r;
+        while (iovcnt > 0 && r >= pIov->iov_len) {
+            r -= pIov->iov_len;
+            pIov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            pIov->iov_base = (char *)pIov->iov_base + r;
+            pIov->iov_len -= r;
+        }
+    }
+    return bytesWritten;
+}
+
 int MEM_ATTR httpdPlatSendData(HttpdInstance *pInstance, HttpdConnData *pConn, char *buff, int len) {
     int bytesWritten;
 #ifdef CONFIG_ESPHTTPD_SSL_SUPPORT
@@ -37,20 +145,102 @@ int MEM_ATTR httpdPlatSendData(HttpdInstance *pInstance, HttpdConnData *pConn, c
 
 #ifdef CONFIG_ESPHTTPD_SSL_SUPPORT
     if(pFR->httpdFlags & HTTPD_FLAG_SSL) {
-        bytesWritten = SSL_write(pRconn->ssl, buff, len);
+        if (pFR->sslConfig.coalesceSize > 0) {
+            bytesWritten = platSslCoalesce(pFR, pRconn, buff, len);
+        } else {
+            bytesWritten = platSslWrite(pRconn, buff, len);
+        }
     } else
 #endif
-    bytesWritten = write(pRconn->fd, buff, len);
+    {
+        struct iovec iov = { .iov_base = buff, .iov_len = len };
+        bytesWritten = platWritevAll(pRconn, &iov, 1);
+    }
 
     return bytesWritten;
 }
 
+int MEM_ATTR httpdPlatSendIov(HttpdInstance *pInstance, HttpdConnData *pConn, const struct iovec *iov, int iovcnt) {
+    RtosConnType *pRconn = frconn_of_conn(pConn);
+#ifdef CONFIG_ESPHTTPD_SSL_SUPPORT
+    HttpdFreertosInstance *pFR = fr_of_instance(pInstance);
+
+    if(pFR->httpdFlags & HTTPD_FLAG_SSL) {
+        // no gather write for TLS, with coalescing enabled small pieces still share a record
+        int bytesWritten = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            int r = httpdPlatSendData(pInstance, pConn, iov[i].iov_base, iov[i].iov_len);
+            if (r != iov[i].iov_len) { return -1; }
+            bytesWritten += r;
+        }
+        return bytesWritten;
+    }
+#endif
+    pRconn->needWriteDoneNotif=1;
+
+    struct iovec pending[HTTPD_PLAT_IOV_MAX];
+    if (iovcnt > HTTPD_PLAT_IOV_MAX) {
+        ESP_LOGE(TAG, "%d buffers, at most %d supported", iovcnt, HTTPD_PLAT_IOV_MAX);
+        return -1;
+    }
+    memcpy(pending, iov, iovcnt * sizeof(struct iovec));
+    return platWritevAll(pRconn, pending, iovcnt);
+}
+
+int MEM_ATTR httpdPlatSendNonblock(HttpdInstance *pInstance, HttpdConnData *pConn, const char *buff, int len) {
+    struct iovec iov = { .iov_base = (char *)buff, .iov_len = len };
+    return httpdPlatSendIovNonblock(pInstance, pConn, &iov, 1);
+}
+
+int MEM_ATTR httpdPlatSendIovNonblock(HttpdInstance *pInstance, HttpdConnData *pConn, const struct iovec *iov, int iovcnt) {
+    RtosConnType *pRconn = frconn_of_conn(pConn);
+#ifdef CONFIG_ESPHTTPD_SSL_SUPPORT
+    HttpdFreertosInstance *pFR = fr_of_instance(pInstance);
+
+    if(pFR->httpdFlags & HTTPD_FLAG_SSL) {
+        // records can't be written partially, fall back to a blocking write
+        return httpdPlatSendIov(pInstance, pConn, iov, iovcnt);
+    }
+#endif
+    int len = 0;
+    for (int i = 0; i < iovcnt; i++) { len += iov[i].iov_len; }
+
+    pRconn->needWriteDoneNotif=1;
+    struct msghdr msg = { .msg_iov = (struct iovec *)iov, .msg_iovlen = iovcnt };
+    int r = sendmsg(pRconn->fd, &msg, MSG_DONTWAIT);
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { r = 0; }
+    if (r >= 0 && r < len) {
+        // the sent callback needs the server task to watch for writability, which it
+        // only starts doing once select() returns when called from another task
+        httpdPlatWake(pInstance);
+    }
+    return r;
+}
+
+int MEM_ATTR httpdPlatFlushData(HttpdInstance *pInstance, HttpdConnData *pConn) {
+#ifdef CONFIG_ESPHTTPD_SSL_SUPPORT
+    HttpdFreertosInstance *pFR = fr_of_instance(pInstance);
+    RtosConnType *pRconn = frconn_of_conn(pConn);
+
+    if(pFR->httpdFlags & HTTPD_FLAG_SSL) {
+        return platSslFlushCoalesced(pRconn);
+    }
+#endif
+    return 0;
+}
+
 void MEM_ATTR httpdPlatDisconnect(HttpdConnData *pConn) {
     RtosConnType *pRconn = frconn_of_conn(pConn);
     pRconn->needsClose=1;
     pRconn->needWriteDoneNotif=1; //because the real close is done in the writable select code
 }
 
+void MEM_ATTR httpdPlatAbort(HttpdConnData *pConn) {
+    RtosConnType *pRconn = frconn_of_conn(pConn);
+    // select() reports the socket readable, the read fails and the connection is closed
+    shutdown(pRconn->fd, SHUT_RDWR);
+}
+
 void MEM_ATTR httpdPlatDisableTimeout(HttpdConnData *pConn) {
     //Unimplemented for FreeRTOS
 }
@@ -70,8 +260,9 @@ void MEM_ATTR closeConnection(HttpdFreertosInstance *pInstance, RtosConnType *rc
     httpdDisconCb(&pInstance->httpdInstance, &rconn->connData);
 
 #ifdef CONFIG_ESPHTTPD_SSL_SUPPORT
-    if(pInstance->httpdFlags & HTTPD_FLAG_SSL) {
+    if((pInstance->httpdFlags & HTTPD_FLAG_SSL) && rconn->sslState == SslStateEstablished) {
         int retval;
+        platSslFlushCoalesced(rconn);
         retval = SSL_shutdown(rconn->ssl);
         if(retval == 1) {
             ESP_LOGD(TAG, "%s success", "SSL_shutdown()");
@@ -92,6 +283,10 @@ void MEM_ATTR closeConnection(HttpdFreertosInstance *pInstance, RtosConnType *rc
         SSL_free(rconn->ssl);
         ESP_LOGD(TAG, "SSL_free() complete");
         rconn->ssl = 0;
+        rconn->sslState = SslStateEstablished;
+        free(rconn->coalesceBuf);
+        rconn->coalesceBuf = NULL;
+        rconn->coalesceLen = 0;
     }
 #endif
 }
@@ -141,6 +336,45 @@ static bool sslSetDerCertificateAndKey(HttpdFreertosInstance *pInstance,
 
 #endif
 
+#ifdef CONFIG_ESPHTTPD_SSL_SUPPORT
+/**
+ * Advance the TLS handshake of a connection, called when its socket is ready.
+ *
+ * The socket is non-blocking during the handshake so a slow client can't stall the
+ * server task, SSL_accept() tells us what the socket has to wait for next.
+ */
+static void platSslHandshake(HttpdFreertosInstance *pInstance, RtosConnType *pRconn) {
+    int32 retAcceptSSL = SSL_accept(pRconn->ssl);
+    if (retAcceptSSL == 1) {
+        // handshake complete, the rest of the connection uses blocking i/o, writes bounded
+        // by the send timeout
+        fcntl(pRconn->fd, F_SETFL, fcntl(pRconn->fd, F_GETFL, 0) & ~O_NONBLOCK);
+        pRconn->sslState = SslStateEstablished;
+        ESP_LOGD(TAG, "SSL_accept OK");
+        return;
+    }
+
+    int ssl_error = SSL_get_error(pRconn->ssl, retAcceptSSL);
+    if (ssl_error == SSL_ERROR_WANT_READ) {
+        pRconn->sslState = SslStateHandshakeWantRead;
+    } else if (ssl_error == SSL_ERROR_WANT_WRITE) {
+        pRconn->sslState = SslStateHandshakeWantWrite;
+    } else {
+        ESP_LOGE(TAG, "SSL_accept %d", ssl_error);
+        closeConnection(pInstance, pRconn);
+    }
+}
+#endif
+
+#if defined(CONFIG_ESPHTTPD_SHUTDOWN_SUPPORT) || defined(CONFIG_ESPHTTPD_SSL_SUPPORT)
+//Make sure select() returns by 'deadline'
+static void platWakeBefore(TickType_t *wakeTicks, TickType_t deadline) {
+    int32_t remaining = (int32_t)(deadline - xTaskGetTickCount());
+    if (remaining < 0) { remaining = 0; }
+    if ((TickType_t)remaining < *wakeTicks) { *wakeTicks = remaining; }
+}
+#endif
+
 #define PLAT_TASK_EXIT vTaskDelete(NULL)
 
 PLAT_RETURN platHttpServerTask(void *pvParameters) {
@@ -165,10 +399,12 @@ void platHttpServerTaskInit(ServerTaskContext *ctx, HttpdFreertosInstance *pInst
     int idxConnection = 0;
     for (idxConnection=0; idxConnection < ctx->pInstance->httpdInstance.maxConnections; idxConnection++) {
         ctx->pInstance->rconn[idxConnection].fd=-1;
+#ifdef CONFIG_ESPHTTPD_SSL_SUPPORT
+        ctx->pInstance->rconn[idxConnection].coalesceBuf=NULL;
+#endif
     }
 
-#ifdef CONFIG_ESPHTTPD_SHUTDOWN_SUPPORT
-    static int currentUdpShutdownPort = 8000;
+    static int currentUdpCtrlPort = 8000;
 
     struct sockaddr_in udp_addr;
     memset(&udp_addr, 0, sizeof(udp_addr)); /* Zero out structure */
@@ -178,11 +414,11 @@ void platHttpServerTaskInit(ServerTaskContext *ctx, HttpdFreertosInstance *pInst
     udp_addr.sin_len = sizeof(udp_addr);
     #endif
 
-    // FIXME: use and increment of currentUdpShutdownPort is not thread-safe
+    // FIXME: use and increment of currentUdpCtrlPort is not thread-safe
     // and should use a mutex
-    ctx->pInstance->udpShutdownPort = currentUdpShutdownPort;
-    currentUdpShutdownPort++;
-    udp_addr.sin_port = htons(ctx->pInstance->udpShutdownPort);
+    ctx->pInstance->udpCtrlPort = currentUdpCtrlPort;
+    currentUdpCtrlPort++;
+    udp_addr.sin_port = htons(ctx->pInstance->udpCtrlPort);
 
     ctx->udpListenFd = socket(AF_INET, SOCK_DGRAM, 0);
     ESP_LOGI(TAG, "ctx->udpListenFd %d", ctx->udpListenFd);
@@ -190,8 +426,18 @@ void platHttpServerTaskInit(ServerTaskContext *ctx, HttpdFreertosInstance *pInst
         ESP_LOGE(TAG, "udp bind failure");
         PLAT_TASK_EXIT;
     }
-    ESP_LOGI(TAG, "shutdown bound to udp port %d", ctx->pInstance->udpShutdownPort);
-#endif
+    ESP_LOGI(TAG, "control bound to udp port %d", ctx->pInstance->udpCtrlPort);
+
+    ctx->pInstance->serverTask = xTaskGetCurrentTaskHandle();
+    ctx->pInstance->wakePending = false;
+    ctx->pInstance->postQueue = xQueueCreate(HTTPD_PLAT_POST_QUEUE_LEN, sizeof(PlatPostedCall));
+    if (ctx->pInstance->postQueue == NULL) {
+        ESP_LOGE(TAG, "post queue");
+    }
+    ctx->pInstance->udpCtrlFd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (ctx->pInstance->udpCtrlFd < 0) {
+        ESP_LOGE(TAG, "control socket");
+    }
 
     /* Construct local address structure */
     struct sockaddr_in server_addr;
@@ -248,6 +494,44 @@ void platHttpServerTaskInit(ServerTaskContext *ctx, HttpdFreertosInstance *pInst
     ctx->listeningForNewConnections = false;
 }
 
+#ifdef CONFIG_ESPHTTPD_SHUTDOWN_SUPPORT
+/**
+ * Close the connections that have nothing left to do while the server is draining
+ *
+ * @return true when draining is over, either because all connections are closed or
+ *         because the drain deadline has passed
+ */
+static bool platDrainConnections(ServerTaskContext *ctx) {
+    int openConnections = 0;
+
+    httpdPlatLock(&ctx->pInstance->httpdInstance);
+    int idxConnection = 0;
+    for(idxConnection=0; idxConnection < ctx->pInstance->httpdInstance.maxConnections; idxConnection++) {
+        RtosConnType *pRconn = &(ctx->pInstance->rconn[idxConnection]);
+        if (pRconn->fd == -1) { continue; }
+
+        if (!pRconn->needWriteDoneNotif && httpdConnIsIdle(&pRconn->connData)) {
+            closeConnection(ctx->pInstance, pRconn);
+        } else {
+            openConnections++;
+        }
+    }
+    httpdPlatUnlock(&ctx->pInstance->httpdInstance);
+
+    if (openConnections == 0) {
+        ESP_LOGI(TAG, "all connections drained on '%s'", ctx->serverStr);
+        return true;
+    }
+
+    if ((int32_t)(xTaskGetTickCount() - ctx->pInstance->drainDeadline) >= 0) {
+        ESP_LOGW(TAG, "drain timeout, %d connections still open on '%s'", openConnections, ctx->serverStr);
+        return true;
+    }
+
+    return false;
+}
+#endif
+
 /**
  * Manually execute the server task loop function once
  */
@@ -256,22 +540,66 @@ void platHttpServerTaskProcess(ServerTaskContext *ctx) {
     fd_set readset,writeset;
     int socketsFull = 1;
     int maxfdp = 0;
+    struct timeval *selectTimeout = ctx->selectTimeoutData;
+    struct timeval wakeTimeout;
+    TickType_t wakeTicks = portMAX_DELAY;
     FD_ZERO(&readset);
     FD_ZERO(&writeset);
 
+    // calls posted from the server task itself don't wake it up
+    if (ctx->pInstance->postQueue && uxQueueMessagesWaiting(ctx->pInstance->postQueue)) {
+        wakeTicks = 0;
+    }
+
+#ifdef CONFIG_ESPHTTPD_SHUTDOWN_SUPPORT
+    if (ctx->pInstance->httpdInstance.isDraining) {
+        if (platDrainConnections(ctx)) {
+            ctx->shutdown = true;
+            return;
+        }
+        platWakeBefore(&wakeTicks, ctx->pInstance->drainDeadline);
+    }
+#endif
+
     int idxConnection = 0;
     for(idxConnection=0; idxConnection < ctx->pInstance->httpdInstance.maxConnections; idxConnection++) {
         RtosConnType *pRconn = &(ctx->pInstance->rconn[idxConnection]);
         if (pRconn->fd != -1) {
-            FD_SET(pRconn->fd, &readset);
-            if (pRconn->needWriteDoneNotif) { FD_SET(pRconn->fd, &writeset); }
+#ifdef CONFIG_ESPHTTPD_SSL_SUPPORT
+            if (pRconn->sslState != SslStateEstablished) {
+                // handshake in progress, wait for what SSL_accept() asked for
+                if (pRconn->sslState == SslStateHandshakeWantWrite) {
+                    FD_SET(pRconn->fd, &writeset);
+                } else {
+                    FD_SET(pRconn->fd, &readset);
+                }
+                platWakeBefore(&wakeTicks, pRconn->handshakeDeadline);
+            } else
+#endif
+            {
+                FD_SET(pRconn->fd, &readset);
+                if (pRconn->needWriteDoneNotif) { FD_SET(pRconn->fd, &writeset); }
+#ifdef CONFIG_ESPHTTPD_SSL_SUPPORT
+                if (pRconn->coalesceLen) { platWakeBefore(&wakeTicks, pRconn->coalesceDeadline); }
+#endif
+            }
             if (pRconn->fd>maxfdp) { maxfdp = pRconn->fd; }
         } else {
             socketsFull = 0;
         }
     }
 
-    if (!socketsFull) {
+    // wake up in time for whatever is waiting on a deadline
+    if (wakeTicks != portMAX_DELAY) {
+        int wakeMs = pdTICKS_TO_MS(wakeTicks);
+        if (!selectTimeout || (selectTimeout->tv_sec * 1000 + selectTimeout->tv_usec / 1000) > wakeMs) {
+            wakeTimeout.tv_sec = wakeMs / 1000;
+            wakeTimeout.tv_usec = (wakeMs % 1000) * 1000;
+            selectTimeout = &wakeTimeout;
+        }
+    }
+
+    if (!socketsFull && !ctx->pInstance->httpdInstance.isDraining) {
         FD_SET(ctx->listenFd, &readset);
         if (ctx->listenFd>maxfdp) maxfdp=ctx->listenFd;
         ESP_LOGD(TAG, "Sel add listen %d", ctx->listenFd);
@@ -286,18 +614,33 @@ void platHttpServerTaskProcess(ServerTaskContext *ctx) {
         }
     }
 
-#ifdef CONFIG_ESPHTTPD_SHUTDOWN_SUPPORT
     FD_SET(ctx->udpListenFd, &readset);
     if(ctx->udpListenFd > maxfdp) maxfdp = ctx->udpListenFd;
-#endif
 
     //polling all exist client handle,wait until readable/writable
     
-    int32 retSelect = select(maxfdp+1, &readset, &writeset, NULL, ctx->selectTimeoutData);
+    int32 retSelect = select(maxfdp+1, &readset, &writeset, NULL, selectTimeout);
     ESP_LOGD(TAG, "select retSelect");
-    if(retSelect <= 0) { return; }
-#ifdef CONFIG_ESPHTTPD_SHUTDOWN_SUPPORT
+    // NOTE: on timeout we still walk the connections so deadlines are enforced
+    if(retSelect < 0) { return; }
     if (FD_ISSET(ctx->udpListenFd, &readset)) {
+        // wake ups carry no data, select() returning is all they are for
+        char wake;
+        while (recv(ctx->udpListenFd, &wake, sizeof(wake), MSG_DONTWAIT) >= 0) {}
+        // anything queued by other tasks from here on sends a new wake up
+        ctx->pInstance->wakePending = false;
+    }
+
+    PlatPostedCall call;
+    while (ctx->pInstance->postQueue && xQueueReceive(ctx->pInstance->postQueue, &call, 0) == pdTRUE) {
+        httpdPlatLock(&ctx->pInstance->httpdInstance);
+        call.fn(&ctx->pInstance->httpdInstance, call.arg);
+        httpdPlatUnlock(&ctx->pInstance->httpdInstance);
+    }
+
+#ifdef CONFIG_ESPHTTPD_SHUTDOWN_SUPPORT
+    // set by httpdPlatShutdown(), which keeps waking us until we have exited
+    if (ctx->pInstance->shutdownRequested && !ctx->pInstance->httpdInstance.isDraining) {
         ctx->shutdown = true;
         ESP_LOGI(TAG, "shutting down");
     }
@@ -337,10 +680,20 @@ void platHttpServerTaskProcess(ServerTaskContext *ctx) {
         setsockopt(ctx->remoteFd, IPPROTO_TCP, TCP_KEEPINTVL, (void *)&keepInterval, sizeof(keepInterval));
         setsockopt(ctx->remoteFd, IPPROTO_TCP, TCP_KEEPCNT, (void *)&keepCount, sizeof(keepCount));
         setsockopt(ctx->remoteFd, IPPROTO_TCP, TCP_NODELAY, (void *)&nodelay, sizeof(nodelay));
+        // bounds every blocking write to this client, see platWritevAll()
+        struct timeval sendTimeout = {
+            .tv_sec = HTTPD_SEND_TIMEOUT_MS / 1000,
+            .tv_usec = (HTTPD_SEND_TIMEOUT_MS % 1000) * 1000
+        };
+        setsockopt(ctx->remoteFd, SOL_SOCKET, SO_SNDTIMEO, (void *)&sendTimeout, sizeof(sendTimeout));
 
         pRconn->fd=ctx->remoteFd;
         pRconn->needWriteDoneNotif=0;
         pRconn->needsClose=0;
+#ifdef CONFIG_ESPHTTPD_SSL_SUPPORT
+        pRconn->sslState = SslStateEstablished;
+        pRconn->coalesceLen = 0;
+#endif
 
 #ifdef CONFIG_ESPHTTPD_SSL_SUPPORT
         if(ctx->pInstance->httpdFlags & HTTPD_FLAG_SSL) {
@@ -350,23 +703,16 @@ void platHttpServerTaskProcess(ServerTaskContext *ctx) {
                 ESP_LOGE(TAG, "SSL_new");
                 close(ctx->remoteFd);
                 pRconn->fd = -1;
-                continue;
+                return;
             }
             ESP_LOGD(TAG, "OK");
 
             SSL_set_fd(pRconn->ssl, pRconn->fd);
 
-            ESP_LOGD(TAG, "SSL server accept client .....");
-            int32 retAcceptSSL = SSL_accept(pRconn->ssl);
-            if (!retAcceptSSL) {
-                int ssl_error = SSL_get_error(pRconn->ssl, retAcceptSSL);
-                ESP_LOGE(TAG, "SSL_accept %d", ssl_error);
-                close(ctx->remoteFd);
-                SSL_free(pRconn->ssl);
-                pRconn->fd = -1;
-                continue;
-            }
-            ESP_LOGD(TAG, "OK");
+            // the handshake is driven by the main loop as the socket becomes ready
+            fcntl(pRconn->fd, F_SETFL, fcntl(pRconn->fd, F_GETFL, 0) | O_NONBLOCK);
+            pRconn->sslState = SslStateHandshakeWantRead;
+            pRconn->handshakeDeadline = xTaskGetTickCount() + pdMS_TO_TICKS(HTTPD_SSL_HANDSHAKE_TIMEOUT_MS);
         }
 #endif
         struct sockaddr name;
@@ -379,6 +725,14 @@ void platHttpServerTaskProcess(ServerTaskContext *ctx) {
 
         // NOTE: httpdConnectCb cannot fail
         httpdConnectCb(&ctx->pInstance->httpdInstance, &pRconn->connData);
+
+#ifdef CONFIG_ESPHTTPD_SSL_SUPPORT
+        if(ctx->pInstance->httpdFlags & HTTPD_FLAG_SSL) {
+            // the ClientHello is often already there, start the handshake right away
+            ESP_LOGD(TAG, "SSL server accept client .....");
+            platSslHandshake(ctx->pInstance, pRconn);
+        }
+#endif
     }
 
     //See if anything happened on the existing connections.
@@ -389,6 +743,18 @@ void platHttpServerTaskProcess(ServerTaskContext *ctx) {
         //Skip empty slots
         if (pRconn->fd == -1) { continue; }
 
+#ifdef CONFIG_ESPHTTPD_SSL_SUPPORT
+        if (pRconn->sslState != SslStateEstablished) {
+            if (FD_ISSET(pRconn->fd, &readset) || FD_ISSET(pRconn->fd, &writeset)) {
+                platSslHandshake(ctx->pInstance, pRconn);
+            } else if ((int32_t)(xTaskGetTickCount() - pRconn->handshakeDeadline) >= 0) {
+                ESP_LOGE(TAG, "SSL handshake timeout");
+                closeConnection(ctx->pInstance, pRconn);
+            }
+            continue;
+        }
+#endif
+
         //Check for write availability first: the read routines may write needWriteDoneNotif while
         //the select didn't check for that.
         if (pRconn->needWriteDoneNotif && FD_ISSET(pRconn->fd, &writeset)) {
@@ -455,6 +821,18 @@ void platHttpServerTaskProcess(ServerTaskContext *ctx) {
             }
 #endif
         }
+
+#ifdef CONFIG_ESPHTTPD_SSL_SUPPORT
+        // send coalesced writes once they have waited long enough
+        httpdPlatLock(&ctx->pInstance->httpdInstance);
+        if (pRconn->fd != -1 && pRconn->coalesceLen &&
+            (int32_t)(xTaskGetTickCount() - pRconn->coalesceDeadline) >= 0) {
+            if (platSslFlushCoalesced(pRconn) != 0) {
+                closeConnection(ctx->pInstance, pRconn);
+            }
+        }
+        httpdPlatUnlock(&ctx->pInstance->httpdInstance);
+#endif
     }
 }
 
@@ -465,6 +843,8 @@ PLAT_RETURN platHttpServerTaskDeinit(ServerTaskContext *ctx) {
 #ifdef CONFIG_ESPHTTPD_SHUTDOWN_SUPPORT
     close(ctx->listenFd);
     close(ctx->udpListenFd);
+    close(ctx->pInstance->udpCtrlFd);
+    ctx->pInstance->udpCtrlFd = -1;
 
     // close all open connections
     int idxConnection = 0;
@@ -476,6 +856,17 @@ PLAT_RETURN platHttpServerTaskDeinit(ServerTaskContext *ctx) {
         }
     }
 
+    if (ctx->pInstance->httpdInstance.websockRegistryFree != NULL) {
+        ctx->pInstance->httpdInstance.websockRegistryFree(&ctx->pInstance->httpdInstance);
+    }
+
+    // calls still queued are dropped, what they were posted for is gone
+    xQueueHandle postQueue = ctx->pInstance->postQueue;
+    ctx->pInstance->postQueue = NULL;
+    if (postQueue) {
+        vQueueDelete(postQueue);
+    }
+
     ESP_LOGI(TAG, "httpd on %s exiting", ctx->serverStr);
     ctx->pInstance->isShutdown = true;
 #endif /* #ifdef CONFIG_ESPHTTPD_SHUTDOWN_SUPPORT */
@@ -489,6 +880,10 @@ HttpdPlatTimerHandle MEM_ATTR httpdPlatTimerCreate(const char *name, int periodM
     return ret;
 }
 
+void* MEM_ATTR httpdPlatTimerGetContext(HttpdPlatTimerHandle timer) {
+    return pvTimerGetTimerID(timer);
+}
+
 void MEM_ATTR httpdPlatTimerStart(HttpdPlatTimerHandle timer) {
     xTimerStart(timer, 0);
 }
@@ -514,12 +909,22 @@ HttpdInitStatus httpdFreertosInitEx(HttpdFreertosInstance *pInstance,
 
     pInstance->httpdInstance.builtInUrls=fixedUrls;
     pInstance->httpdInstance.maxConnections = maxConnections;
+    pInstance->httpdInstance.isDraining = false;
+    // created on the first websocket, freed by platHttpServerTaskDeinit()
+    pInstance->httpdInstance.websockRegistry = NULL;
+    pInstance->httpdInstance.websockRegistryFree = NULL;
 
     status = InitializationSuccess;
     pInstance->httpPort = port;
     pInstance->httpListenAddress.sin_addr.s_addr = listenAddress;
     pInstance->httpdFlags = flags;
     pInstance->isShutdown = false;
+    pInstance->udpCtrlFd = -1;
+    pInstance->serverTask = NULL;
+    pInstance->postQueue = NULL;
+#ifdef CONFIG_ESPHTTPD_SHUTDOWN_SUPPORT
+    pInstance->shutdownRequested = false;
+#endif
 
     pInstance->rconn = connectionBuffer;
 
@@ -545,7 +950,8 @@ HttpdInitStatus httpdFreertosInit(HttpdFreertosInstance *pInstance,
     return status;
 }
 
-SslInitStatus httpdFreertosSslInit(HttpdFreertosInstance *pInstance) {
+SslInitStatus httpdFreertosSslInitEx(HttpdFreertosInstance *pInstance,
+                                     const HttpdFreertosSslConfig *config) {
     SslInitStatus status = SslInitSuccess;
 
 #ifdef CONFIG_ESPHTTPD_SSL_SUPPORT
@@ -553,14 +959,21 @@ SslInitStatus httpdFreertosSslInit(HttpdFreertosInstance *pInstance) {
         pInstance->ctx = sslCreateContext();
         if(!pInstance->ctx) {
             ESP_LOGE(TAG, "create ssl context");
-            status = StartFailedSslNotConfigured;
+            status = SslInitContextCreationFailed;
         }
+        pInstance->sslConfig = *config;
     }
 #endif
 
     return status;
 }
 
+SslInitStatus httpdFreertosSslInit(HttpdFreertosInstance *pInstance) {
+    HttpdFreertosSslConfig config = { 0 };
+
+    return httpdFreertosSslInitEx(pInstance, &config);
+}
+
 void httpdFreertosSslSetCertificateAndKey(HttpdFreertosInstance *pInstance,
                                         const void *certificate, size_t certificate_size,
                                         const void *private_key, size_t private_key_size)
@@ -644,10 +1057,55 @@ HttpdStartStatus httpdFreertosStart(HttpdFreertosInstance *pInstance)
     return StartSuccess;
 }
 
+static void platCtrlAddr(HttpdFreertosInstance *pFR, struct sockaddr_in *udp_addr)
+{
+    memset(udp_addr, 0, sizeof(*udp_addr)); /* Zero out structure */
+    udp_addr->sin_family = AF_INET;			/* Internet address family */
+    udp_addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    udp_addr->sin_len = sizeof(*udp_addr);
+    udp_addr->sin_port = htons(pFR->udpCtrlPort);
+}
+
+//Send a wake up, one byte that is thrown away, over the control socket
+static bool platCtrlSend(HttpdFreertosInstance *pFR, int fd)
+{
+    struct sockaddr_in udp_addr;
+    const char wake = 0;
+    platCtrlAddr(pFR, &udp_addr);
+    return sendto(fd, &wake, sizeof(wake), 0,
+            (struct sockaddr*)&udp_addr, sizeof(udp_addr)) == sizeof(wake);
+}
+
+void MEM_ATTR httpdPlatWake(HttpdInstance *pInstance)
+{
+    HttpdFreertosInstance *pFR = fr_of_instance(pInstance);
+
+    if (pFR->udpCtrlFd < 0 || pFR->wakePending || xTaskGetCurrentTaskHandle() == pFR->serverTask) {
+        return;
+    }
+    pFR->wakePending = true;
+
+    if (!platCtrlSend(pFR, pFR->udpCtrlFd)) {
+        ESP_LOGE(TAG, "wake sendto");
+        pFR->wakePending = false;
+    }
+}
+
+bool MEM_ATTR httpdPlatPost(HttpdInstance *pInstance, HttpdPlatPostFn fn, void *arg)
+{
+    HttpdFreertosInstance *pFR = fr_of_instance(pInstance);
+
+    PlatPostedCall call = { .fn = fn, .arg = arg };
+    xQueueHandle postQueue = pFR->postQueue;
+
+    if (postQueue == NULL || xQueueSend(postQueue, &call, 0) != pdTRUE) { return false; }
+    httpdPlatWake(pInstance);
+    return true;
+}
+
 #ifdef CONFIG_ESPHTTPD_SHUTDOWN_SUPPORT
 void httpdPlatShutdown(HttpdInstance *pInstance)
 {
-    int err;
     HttpdFreertosInstance *pFR = fr_of_instance(pInstance);
 
     int s = socket(AF_INET, SOCK_DGRAM, 0);
@@ -655,19 +1113,12 @@ void httpdPlatShutdown(HttpdInstance *pInstance)
         ESP_LOGE(TAG, "socket %d", s);
     }
 
-    struct sockaddr_in udp_addr;
-    memset(&udp_addr, 0, sizeof(udp_addr)); /* Zero out structure */
-    udp_addr.sin_family = AF_INET;			/* Internet address family */
-    udp_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-    udp_addr.sin_len = sizeof(udp_addr);
-    udp_addr.sin_port = htons(pFR->udpShutdownPort);
-
+    pFR->shutdownRequested = true;
     while(!pFR->isShutdown) {
-        ESP_LOGI(TAG, "sending shutdown to port %d", pFR->udpShutdownPort);
+        ESP_LOGI(TAG, "sending shutdown to port %d", pFR->udpCtrlPort);
 
-        err = sendto(s, pFR, sizeof(pFR), 0,
-                (struct sockaddr*)&udp_addr, sizeof(udp_addr));
-        if(err != sizeof(pFR)) {
+        // a wake up can get lost, keep sending them until the server task has exited
+        if(!platCtrlSend(pFR, s)) {
             ESP_LOGE(TAG, "sendto");
             perror("sendto");
         }
@@ -685,4 +1136,16 @@ void httpdPlatShutdown(HttpdInstance *pInstance)
 
     close(s);
 }
+
+void httpdPlatDrain(HttpdInstance *pInstance, int timeoutMs)
+{
+    HttpdFreertosInstance *pFR = fr_of_instance(pInstance);
+
+    httpdPlatLock(pInstance);
+    pFR->drainDeadline = xTaskGetTickCount() + pdMS_TO_TICKS(timeoutMs);
+    pInstance->isDraining = true;
+    httpdPlatUnlock(pInstance);
+
+    ESP_LOGI(TAG, "draining connections on port %d, timeout %d ms", pFR->httpPort, timeoutMs);
+}
 #endif
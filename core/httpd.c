@@ -15,6 +15,7 @@ Http server - core routines
 
 #include <strings.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "libesphttpd/httpd-freertos.h"
 #include "libesphttpd/httpd.h"
@@ -89,6 +90,143 @@ void httpdAddCacheHeaders(HttpdConnData *connData, const char *mime)
     httpdHeader(connData, "Cache-Control", "max-age=7200, public, must-revalidate");
 }
 
+static const char *httpDays[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+static const char *httpMonths[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+//Days since 1970-01-01 of a date in the proleptic Gregorian calendar
+static long httpdDaysFromCivil(int y, int m, int d) {
+    y -= m <= 2;
+    long era = (y >= 0 ? y : y - 399) / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+//Parse an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"), the only format sent these days.
+//Returns 0 for anything else.
+static time_t httpdParseDate(const char *date) {
+    char mon[4];
+    int day, year, hour, min, sec;
+    if (sscanf(date, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT", &day, mon, &year, &hour, &min, &sec) != 6) return 0;
+    for (int m = 0; m < 12; m++) {
+        if (strcmp(mon, httpMonths[m]) == 0) {
+            return (time_t)httpdDaysFromCivil(year, m + 1, day) * 86400 + hour * 3600 + min * 60 + sec;
+        }
+    }
+    return 0;
+}
+
+void MEM_ATTR httpdValidatorHeaders(HttpdConnData *conn, const char *etag, time_t lastModified) {
+    if (etag) httpdHeader(conn, "ETag", etag);
+    if (lastModified > 0) {
+        char buff[32];
+        struct tm tm;
+        gmtime_r(&lastModified, &tm);
+        snprintf(buff, sizeof(buff), "%s, %02d %s %04d %02d:%02d:%02d GMT", httpDays[tm.tm_wday], tm.tm_mday,
+                 httpMonths[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+        httpdHeader(conn, "Last-Modified", buff);
+    }
+}
+
+//Whether tag is in the If-None-Match list. Compared weakly, as RFC 7232 asks for this header.
+static bool httpdEtagListed(const char *list, const char *tag) {
+    if (strncmp(tag, "W/", 2) == 0) tag += 2;
+    int tagLen = strlen(tag);
+    const char *p = list;
+    while (*p) {
+        while (*p == ' ' || *p == ',') p++;
+        if (*p == '*') return true;
+        if (strncmp(p, "W/", 2) == 0) p += 2;
+        const char *start = p;
+        while (*p && *p != ',' && *p != ' ') p++;
+        if (p - start == tagLen && strncmp(start, tag, tagLen) == 0) return true;
+    }
+    return false;
+}
+
+bool MEM_ATTR httpdIsNotModified(HttpdConnData *conn, const char *etag, time_t lastModified) {
+    char buff[128];
+    if (conn->requestType != HTTPD_METHOD_GET) return false;
+    // If-None-Match wins, If-Modified-Since is only looked at without it
+    if (httpdGetHeader(conn, "If-None-Match", buff, sizeof(buff))) {
+        return etag != NULL && httpdEtagListed(buff, etag);
+    }
+    if (lastModified > 0 && httpdGetHeader(conn, "If-Modified-Since", buff, sizeof(buff))) {
+        time_t since = httpdParseDate(buff);
+        return since > 0 && lastModified <= since;
+    }
+    return false;
+}
+
+int MEM_ATTR httpdGetRanges(HttpdConnData *conn, long size, const char *etag, time_t lastModified,
+                            HttpdRange *ranges, int maxRanges) {
+    char buff[128];
+    if (conn->requestType != HTTPD_METHOD_GET) return 0;
+    if (!httpdGetHeader(conn, "Range", buff, sizeof(buff)) || strncasecmp(buff, "bytes=", 6) != 0) return 0;
+    // a cut off list can't be trusted
+    if (strlen(buff) == sizeof(buff) - 1) return 0;
+
+    char ifRange[64];
+    if (httpdGetHeader(conn, "If-Range", ifRange, sizeof(ifRange))) {
+        // the ranges only apply to the version the client has, else it gets all of the new one
+        if (ifRange[0] == '"') {
+            if (etag == NULL || strcmp(ifRange, etag) != 0) return 0;
+        } else {
+            if (lastModified == 0 || httpdParseDate(ifRange) != lastModified) return 0;
+        }
+    }
+
+    int count = 0;
+    bool any = false;
+    const char *p = &buff[6];
+    while (*p) {
+        HttpdRange r;
+        char *end;
+        while (*p == ' ' || *p == ',') p++;
+        if (*p == 0) break;
+        if (*p == '-') {
+            // suffix: the last n bytes
+            long n = strtol(p + 1, &end, 10);
+            if (end == p + 1 || n < 0) return 0;
+            if (n == 0) {
+                p = end;
+                continue;
+            }
+            r.start = (n >= size) ? 0 : size - n;
+            r.end = size - 1;
+        } else {
+            r.start = strtol(p, &end, 10);
+            if (end == p || *end != '-' || r.start < 0) return 0;
+            p = end + 1;
+            if (*p >= '0' && *p <= '9') {
+                r.end = strtol(p, &end, 10);
+                if (r.end < r.start) return 0;
+            } else {
+                end = (char *)p;
+                r.end = size - 1;
+            }
+            if (r.end >= size) r.end = size - 1;
+        }
+        p = end;
+        while (*p == ' ') p++;
+        if (*p != ',' && *p != 0) return 0;
+        if (r.start >= size) continue; // unsatisfiable, the others may still be
+        any = true;
+        // too many to bother with, the whole thing is cheaper
+        if (count == maxRanges) return 0;
+        ranges[count++] = r;
+    }
+    return any ? count : -1;
+}
+
+void MEM_ATTR httpdSendNotModified(HttpdConnData *conn, const char *etag, time_t lastModified) {
+    httpdStartResponse(conn, 304);
+    httpdValidatorHeaders(conn, etag, lastModified);
+    // 304 has no body, so no chunks either: end the headers without switching to the body
+    httpdSend(conn, "\r\n", -1);
+}
+
 //Retires a connection for re-use
 static void MEM_ATTR httpdRetireConn(HttpdInstance *pInstance, HttpdConnData *conn) {
 #ifdef CONFIG_ESPHTTPD_BACKLOG_SUPPORT
@@ -303,6 +441,39 @@ int MEM_ATTR httpdSend(HttpdConnData *conn, const char *data, int len) {
     return 1;
 }
 
+//Reserve room at the end of the send buffer for the caller to fill in place, e.g. with fread().
+//Leaves space for the chunk terminators, so the caller can use all of the returned room.
+//Returns a pointer to the room and its size in *len, or NULL if the buffer is full.
+char* MEM_ATTR httpdSendReserve(HttpdConnData *conn, int *len) {
+    bool chunked = (conn->priv.flags&HFL_CHUNKED && conn->priv.flags&HFL_SENDINGBODY);
+    // the final "0\r\n\r\n" chunk goes in the same buffer when the cgi is done
+    int room = HTTPD_SENDBUFF_MAX_FILL - conn->priv.sendBuffLen - (chunked ? 5 : 0);
+    if (chunked && conn->priv.chunkHdr==NULL) room -= CHUNK_SIZE_TEXT_LEN;
+    if (room <= 0) {
+        *len = 0;
+        return NULL;
+    }
+    if (chunked && conn->priv.chunkHdr==NULL) {
+        conn->priv.chunkHdr = &conn->priv.sendBuff[conn->priv.sendBuffLen];
+        strcpy(conn->priv.chunkHdr, CHUNK_SIZE_TEXT);
+        conn->priv.sendBuffLen+=CHUNK_SIZE_TEXT_LEN;
+    }
+    *len = room;
+    return &conn->priv.sendBuff[conn->priv.sendBuffLen];
+}
+
+//Add len bytes the caller wrote to the room from httpdSendReserve() to the send buffer
+void MEM_ATTR httpdSendCommit(HttpdConnData *conn, int len) {
+    if (len == 0 && conn->priv.chunkHdr == &conn->priv.sendBuff[conn->priv.sendBuffLen - CHUNK_SIZE_TEXT_LEN]) {
+        // an empty chunk would end the response, drop the header again
+        conn->priv.sendBuffLen-=CHUNK_SIZE_TEXT_LEN;
+        conn->priv.chunkHdr=NULL;
+        return;
+    }
+    conn->priv.sendBuffLen+=len;
+    assert(conn->priv.sendBuffLen <= HTTPD_SENDBUFF_MAX_FILL);
+}
+
 static char httpdHexNibble(int val) {
     val&=0xf;
     if (val<10) return '0'+val;
@@ -412,7 +583,12 @@ void MEM_ATTR httpdFlushSendBuffer(HttpdInstance *pInstance, HttpdConnData *conn
     }
     if (conn->priv.sendBuffLen!=0) {
         r = httpdPlatSendData(pInstance, conn, conn->priv.sendBuff, conn->priv.sendBuffLen);
-        if (r != conn->priv.sendBuffLen) {
+        if (r < 0) {
+            //Peer stopped taking data or went away, part of the buffer may be out. Nothing more
+            //can be sent on this connection, let the server task close it.
+            ESP_LOGE(TAG, "send of %d bytes failed, closing", conn->priv.sendBuffLen);
+            httpdPlatAbort(conn);
+        } else if (r != conn->priv.sendBuffLen) {
 #ifdef CONFIG_ESPHTTPD_BACKLOG_SUPPORT
             //Can't send this for some reason. Dump packet in backlog, we can send it later.
             if (conn->priv.sendBacklogSize+conn->priv.sendBuffLen>HTTPD_MAX_BACKLOG_SIZE) {
@@ -450,6 +626,11 @@ void MEM_ATTR httpdCgiIsDone(HttpdInstance *pInstance, HttpdConnData *conn) {
     if (conn->priv.flags&HFL_CHUNKED) {
         ESP_LOGD(TAG, "cleaning up");
         httpdFlushSendBuffer(pInstance, conn);
+        if (pInstance->isDraining) {
+            //Server is going down, don't wait for another request on this connection.
+            conn->priv.flags=HFL_DISCONAFTERSENT;
+            return;
+        }
         //Note: Do not clean up sendBacklog, it may still contain data at this point.
         conn->priv.headPos=0;
         conn->post.len=-1;
@@ -485,6 +666,7 @@ CallbackStatus httpdContinue(HttpdInstance *pInstance, HttpdConnData * conn) {
         int bytesWritten = httpdPlatSendData(pInstance, conn->conn, conn->priv.sendBacklog->data, conn->priv.sendBacklog->len);
         if(bytesWritten != conn->priv.sendBacklog->len) {
             ESP_LOGE(TAG, "tried to write %d bytes, wrote %d", conn->priv.sendBacklog->len, bytesWritten);
+            if (bytesWritten < 0) httpdPlatAbort(conn);
         }
         conn->priv.sendBacklogSize-=conn->priv.sendBacklog->len;
         free(conn->priv.sendBacklog);
@@ -540,6 +722,11 @@ static void MEM_ATTR httpdProcessRequest(HttpdInstance *pInstance, HttpdConnData
         return; //Shouldn't happen
     }
 
+    if (pInstance->isDraining) {
+        //Answer with 'Connection: close', as if the client asked for it.
+        conn->priv.flags&=~HFL_CHUNKED;
+    }
+
 #ifdef CONFIG_ESPHTTPD_CORS_SUPPORT
     // CORS preflight, allow the token we received before
     if (conn->requestType == HTTPD_METHOD_OPTIONS) {
@@ -753,12 +940,95 @@ CallbackStatus MEM_ATTR httpdConnSendStart(HttpdInstance *pInstance, HttpdConnDa
     return status;
 }
 
+void MEM_ATTR httpdFlushSendBufferNow(HttpdInstance *pInstance, HttpdConnData *conn) {
+    httpdFlushSendBuffer(pInstance, conn);
+    if (httpdPlatFlushData(pInstance, conn) != 0) {
+        ESP_LOGE(TAG, "flush failed");
+    }
+}
+
+static bool MEM_ATTR httpdBodyIsChunked(HttpdConnData *conn) {
+    return (conn->priv.flags&HFL_CHUNKED && conn->priv.flags&HFL_SENDINGBODY);
+}
+
+//Write data out directly instead of through the send buffer, as one chunk when the response is chunked.
+//Whatever is in the send buffer goes first.
+int MEM_ATTR httpdSendDirect(HttpdInstance *pInstance, HttpdConnData *conn, const char *data, int len) {
+    char chunkHead[12];
+    struct iovec iov[3];
+    int iovcnt = 0, total = len;
+    if (len<0) len=total=strlen(data);
+    httpdFlushSendBuffer(pInstance, conn);
+    // an empty chunk would end the response
+    if (len==0) return 1;
+
+    bool chunked = httpdBodyIsChunked(conn);
+    if (chunked) {
+        iov[iovcnt].iov_base = chunkHead;
+        iov[iovcnt++].iov_len = snprintf(chunkHead, sizeof(chunkHead), "%X\r\n", len);
+        total += iov[0].iov_len + 2;
+    }
+    iov[iovcnt].iov_base = (char *)data;
+    iov[iovcnt++].iov_len = len;
+    if (chunked) {
+        iov[iovcnt].iov_base = (char *)"\r\n";
+        iov[iovcnt++].iov_len = 2;
+    }
+    return (httpdPlatSendIov(pInstance, conn, iov, iovcnt) == total);
+}
+
+void MEM_ATTR httpdSendDirectStart(HttpdInstance *pInstance, HttpdConnData *conn, HttpdDirectSend *ds, const char *data, int len) {
+    httpdFlushSendBuffer(pInstance, conn);
+    ds->pos = data;
+    ds->end = data + len;
+    ds->frameLen = 0;
+    ds->frameOff = 0;
+    ds->tailPending = false;
+    // an empty chunk would end the response
+    if (len > 0 && httpdBodyIsChunked(conn)) {
+        ds->frameLen = snprintf(ds->frame, sizeof(ds->frame), "%X\r\n", len);
+        ds->tailPending = true;
+    }
+}
+
+//Write the chunk head, data and chunk tail of ds in turn, as far as the socket takes them.
+int MEM_ATTR httpdSendDirectNonblock(HttpdInstance *pInstance, HttpdConnData *conn, HttpdDirectSend *ds, int maxLen) {
+    int r = 0;
+    if (ds->frameOff < ds->frameLen) {
+        r = httpdPlatSendNonblock(pInstance, conn, &ds->frame[ds->frameOff], ds->frameLen - ds->frameOff);
+        if (r >= 0) ds->frameOff += r;
+    }
+    if (r >= 0 && ds->frameOff == ds->frameLen && ds->pos != ds->end) {
+        int len = ds->end - ds->pos;
+        if (len > maxLen) len = maxLen;
+        r = httpdPlatSendNonblock(pInstance, conn, ds->pos, len);
+        if (r > 0) ds->pos += r;
+        if (r >= 0 && ds->pos == ds->end && ds->tailPending) {
+            ds->frameLen = snprintf(ds->frame, sizeof(ds->frame), "\r\n");
+            ds->frameOff = 0;
+            ds->tailPending = false;
+            r = httpdPlatSendNonblock(pInstance, conn, ds->frame, ds->frameLen);
+            if (r >= 0) ds->frameOff += r;
+        }
+    }
+    if (r < 0) {
+        // the response can't be finished, the server task cleans up the closed socket
+        httpdPlatAbort(conn);
+        return -1;
+    }
+    return (ds->pos == ds->end && ds->frameOff == ds->frameLen && !ds->tailPending) ? 1 : 0;
+}
+
 //Finish the live-ness of a connection. Always call this after httpdConnStart
 void MEM_ATTR httpdConnSendFinish(HttpdInstance *pInstance, HttpdConnData *conn) {
     httpdFlushSendBuffer(pInstance, conn);
     httpdPlatUnlock(pInstance);
 }
 
+bool MEM_ATTR httpdConnIsIdle(HttpdConnData *conn) {
+    return (conn->cgi==NULL && conn->priv.headPos==0 && !(conn->priv.flags&HFL_DISCONAFTERSENT));
+}
+
 //Callback called when there's data available on a socket.
 CallbackStatus MEM_ATTR httpdRecvCb(HttpdInstance *pInstance, HttpdConnData *conn, char *data, unsigned short len) {
     int x, r;
@@ -888,6 +1158,7 @@ void MEM_ATTR httpdConnectCb(HttpdInstance *pInstance, HttpdConnData *pConn) {
 
     memset(pConn, 0, sizeof(HttpdConnData));
     pConn->post.len=-1;
+    pConn->instance=pInstance;
 
     httpdPlatUnlock(pInstance);
 }
@@ -896,4 +1167,9 @@ void MEM_ATTR httpdConnectCb(HttpdInstance *pInstance, HttpdConnData *pConn) {
 void httpdShutdown(HttpdInstance *pInstance) {
     httpdPlatShutdown(pInstance);
 }
+
+void httpdShutdownDrain(HttpdInstance *pInstance, int timeoutMs) {
+    httpdPlatDrain(pInstance, timeoutMs);
+    httpdPlatShutdown(pInstance);
+}
 #endif
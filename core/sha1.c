@@ -5,7 +5,7 @@
 /* This code is public-domain - it is based on libcrypt
  * placed in the public domain by Wei Dai and other contributors.
  */
-// gcc -Wall -DSHA1TEST -o sha1test sha1.c && ./sha1test
+// host tests and benchmark: make -C test/host check bench
 
 #include <stdint.h>
 #include <string.h>
@@ -20,6 +20,33 @@
 
 
 /* code */
+#ifdef CONFIG_ESPHTTPD_SHA1_MBEDTLS
+// mbedtls backend: uses the SHA accelerator when mbedtls is configured for it
+// (CONFIG_MBEDTLS_HARDWARE_SHA) and falls back to software while the engine is busy.
+
+void sha1_init(sha1nfo *s) {
+    mbedtls_sha1_init(&s->ctx);
+    mbedtls_sha1_starts_ret(&s->ctx);
+}
+
+void sha1_write(sha1nfo *s, const char *data, size_t len) {
+    mbedtls_sha1_update_ret(&s->ctx, (const unsigned char *)data, len);
+}
+
+void sha1_writebyte(sha1nfo *s, uint8_t data) {
+    mbedtls_sha1_update_ret(&s->ctx, &data, 1);
+}
+
+uint8_t* sha1_result(sha1nfo *s) {
+    mbedtls_sha1_finish_ret(&s->ctx, (unsigned char *)s->state);
+    mbedtls_sha1_free(&s->ctx);
+
+    // Return pointer to hash (20 characters)
+    return (uint8_t*) s->state;
+}
+
+#else
+
 #define SHA1_K0  0x5a827999
 #define SHA1_K20 0x6ed9eba1
 #define SHA1_K40 0x8f1bbcdc
@@ -95,8 +122,36 @@ void sha1_writebyte(sha1nfo *s, uint8_t data) {
     sha1_addUncounted(s, data);
 }
 
+// Load a whole 64 byte block into the word buffer
+static void sha1_loadBlock(sha1nfo *s, const uint8_t *data) {
+#ifdef SHA_BIG_ENDIAN
+    memcpy(s->buffer, data, BLOCK_LENGTH);
+#else
+    uint8_t i;
+    for (i=0; i<BLOCK_LENGTH/4; i++, data+=4) {
+        s->buffer[i] = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+    }
+#endif
+}
+
 void sha1_write(sha1nfo *s, const char *data, size_t len) {
-    for (;len--;) sha1_writebyte(s, (uint8_t) *data++);
+    const uint8_t *p = (const uint8_t *)data;
+    s->byteCount += len;
+
+    // Top up a partly filled block
+    while (len && s->bufferOffset) {
+        sha1_addUncounted(s, *p++);
+        len--;
+    }
+    // Hash whole blocks straight from the input
+    while (len >= BLOCK_LENGTH) {
+        sha1_loadBlock(s, p);
+        sha1_hashBlock(s);
+        p += BLOCK_LENGTH;
+        len -= BLOCK_LENGTH;
+    }
+    // Keep the rest for the next write
+    while (len--) sha1_addUncounted(s, *p++);
 }
 
 void sha1_pad(sha1nfo *s) {
@@ -137,16 +192,25 @@ uint8_t* sha1_result(sha1nfo *s) {
     return (uint8_t*) s->state;
 }
 
+#endif // CONFIG_ESPHTTPD_SHA1_MBEDTLS
+
 #define HMAC_IPAD 0x36
 #define HMAC_OPAD 0x5c
 
-void sha1_initHmac(sha1nfo *s, const uint8_t* key, int keyLength) {
+// Hash the key xored with the pad as one block
+static void sha1_writeKeyPad(sha1nfo *s, uint8_t pad) {
+    uint8_t block[BLOCK_LENGTH];
     uint8_t i;
+    for (i=0; i<BLOCK_LENGTH; i++) block[i] = s->keyBuffer[i] ^ pad;
+    sha1_write(s, (const char *)block, BLOCK_LENGTH);
+}
+
+void sha1_initHmac(sha1nfo *s, const uint8_t* key, int keyLength) {
     memset(s->keyBuffer, 0, BLOCK_LENGTH);
     if (keyLength > BLOCK_LENGTH) {
         // Hash long keys
         sha1_init(s);
-        for (;keyLength--;) sha1_writebyte(s, *key++);
+        sha1_write(s, (const char *)key, keyLength);
         memcpy(s->keyBuffer, sha1_result(s), HASH_LENGTH);
     } else {
         // Block length keys are used as is
@@ -154,18 +218,15 @@ void sha1_initHmac(sha1nfo *s, const uint8_t* key, int keyLength) {
     }
     // Start inner hash
     sha1_init(s);
-    for (i=0; i<BLOCK_LENGTH; i++) {
-        sha1_writebyte(s, s->keyBuffer[i] ^ HMAC_IPAD);
-    }
+    sha1_writeKeyPad(s, HMAC_IPAD);
 }
 
 uint8_t* sha1_resultHmac(sha1nfo *s) {
-    uint8_t i;
     // Complete inner hash
     memcpy(s->innerHash,sha1_result(s),HASH_LENGTH);
     // Calculate outer hash
     sha1_init(s);
-    for (i=0; i<BLOCK_LENGTH; i++) sha1_writebyte(s, s->keyBuffer[i] ^ HMAC_OPAD);
-    for (i=0; i<HASH_LENGTH; i++) sha1_writebyte(s, s->innerHash[i]);
+    sha1_writeKeyPad(s, HMAC_OPAD);
+    sha1_write(s, (const char *)s->innerHash, HASH_LENGTH);
     return sha1_result(s);
 }
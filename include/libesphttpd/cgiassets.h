@@ -0,0 +1,111 @@
+#ifndef __CGIASSETS_H__
+#define __CGIASSETS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "httpd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//Read-only asset image, as stored in a data partition. Build it with tools/mkassetimage.py, or
+//the libesphttpd_create_asset_image() cmake function. All fields are little endian and offsets
+//count from the start of the image:
+//
+//  AssetImageHeader
+//  uint32_t slots[slotCount]	hash index: entry number + 1, 0 for an empty slot. A path is looked
+//				for from slot (hash & (slotCount - 1)) on until an empty slot.
+//  AssetImageEntry entries[fileCount]
+//  strings and file data
+#define ASSET_IMAGE_MAGIC	0x53414845	// "EHAS"
+#define ASSET_IMAGE_VERSION	2
+
+//Encodings a file can be stored in, in order of preference
+typedef enum {
+	ASSET_ENCODING_BR,
+	ASSET_ENCODING_GZIP,
+	ASSET_ENCODING_IDENTITY,
+	ASSET_ENCODING_COUNT
+} AssetEncoding;
+
+#define ASSET_FLAG_VARIANT(enc)	(1<<(enc))	// entry has a variant in encoding enc
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t flags;
+	uint32_t imageLen;
+	uint32_t fileCount;
+	uint32_t slotCount;	// power of 2
+} AssetImageHeader;
+
+typedef struct {
+	uint32_t dataOffset;
+	uint32_t size;
+	uint32_t etagOffset;	// zero-terminated, quoted strong ETag of this variant
+} AssetImageVariant;
+
+typedef struct {
+	uint32_t hash;		// cgiAssetsHash() of the name
+	uint32_t nameOffset;	// zero-terminated path, e.g. "/index.html"
+	uint32_t mimeOffset;	// zero-terminated Content-Type
+	uint32_t flags;		// ASSET_FLAG_VARIANT() of the variants present
+	AssetImageVariant variants[ASSET_ENCODING_COUNT];
+} AssetImageEntry;
+
+typedef struct {
+	const uint8_t *image;
+	uint32_t len;
+	const uint32_t *slots;
+	const AssetImageEntry *entries;
+	int mapping;		// how the image got mapped, for cgiAssetsUnmount
+	uint32_t mapHandle;
+} AssetStore;
+
+/**
+ * Map the asset image in the data partition with the given label
+ *
+ * The image is checked once here; files are served straight from the mapped flash.
+ * Returns false if there is no such partition or it holds no valid image.
+ */
+bool cgiAssetsMountPartition(AssetStore *store, const char *label);
+
+/**
+ * Use an asset image that is already in memory, e.g. embedded in the application binary
+ */
+bool cgiAssetsMountImage(AssetStore *store, const void *image, size_t len);
+
+#ifdef CONFIG_IDF_TARGET_LINUX
+/**
+ * mmap() an asset image file, for host builds
+ */
+bool cgiAssetsMountFile(AssetStore *store, const char *path);
+#endif
+
+void cgiAssetsUnmount(AssetStore *store);
+
+/**
+ * Hash used for the index, FNV-1a over the path
+ */
+uint32_t cgiAssetsHash(const char *path);
+
+/**
+ * Look up path in store, NULL if it's not there
+ */
+const AssetImageEntry *cgiAssetsFind(const AssetStore *store, const char *path);
+
+/**
+ * Static file server for an asset image, cgiArg is the AssetStore
+ *
+ * Like cgiEspVfsGet, a url ending in / gets index.html. The smallest variant the client accepts
+ * (brotli, gzip or as is) is sent from the image without copying, with the mime type and ETag
+ * stored in the image. Returns NOT_FOUND for anything else, so later routes can handle it.
+ */
+CgiStatus cgiAssets(HttpdConnData *connData);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef __CGISSE_H__
+#define __CGISSE_H__
+
+#include "httpd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct SseStreamPriv SseStreamPriv;
+
+//A stream of server-sent events. Define one per event source url and pass it to ROUTE_SSE; the
+//settings are read when the first client connects or the first event is sent.
+typedef struct {
+	int historySize;	// recent events kept for clients resuming with Last-Event-ID, 0 for none
+	int retryMs;		// reconnect delay suggested to clients, 0 to leave it to the browser
+	int heartbeatMs;	// interval of the comment lines that keep idle connections checked, 0 for none
+	SseStreamPriv *priv;
+} SseStream;
+
+/**
+ * Server-sent events (text/event-stream) endpoint, cgiArg is the SseStream
+ *
+ * Holds the connection open and adds it to the subscribers of the stream. A client reconnecting
+ * with a Last-Event-ID header first gets the events it missed, as far as the history reaches.
+ * A stream serves the connections of one server instance.
+ *
+ * With heartbeatMs set every client gets an empty comment line that often, so connections that
+ * went away without closing fail a write and are dropped instead of holding a connection slot.
+ */
+CgiStatus cgiSse(HttpdConnData *connData);
+
+/**
+ * Send an event to all subscribers of stream
+ *
+ * The event is formatted once, gets the next event id and is kept in the history. event is the
+ * event type, NULL for the default 'message', and must be a single line; data may span several
+ * lines, ended by \r\n, \r or \n. Returns the number of subscribers sent to, 0 for an event
+ * type with a line break, which is not sent.
+ *
+ * The event is written to each subscriber in turn with a blocking write while holding the server
+ * lock. A subscriber whose socket is full holds up the caller, the server task and the rest of
+ * the subscribers until it takes more data; one that takes nothing for HTTPD_SEND_TIMEOUT_MS
+ * (the send timeout of client sockets) fails the write and is closed. Replays and heartbeats
+ * are written the same way. Use heartbeatMs so vanished clients are found between broadcasts.
+ */
+int cgiSseBroadcast(HttpdInstance *pInstance, SseStream *stream, const char *event, const char *data);
+
+/**
+ * Number of clients subscribed to stream
+ */
+int cgiSseClientCount(SseStream *stream);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
@@ -3,10 +3,14 @@
 
 #include "httpd.h"
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
 #define WEBSOCK_FLAG_NONE 0
 #define WEBSOCK_FLAG_MORE (1<<0) //Set if the data is not the final data in the message; more follows
 #define WEBSOCK_FLAG_BIN (1<<1) //Set if the data is binary instead of text
 #define WEBSOCK_FLAG_CONT (1<<2) //set if this is a continuation frame (after WEBSOCK_FLAG_CONT)
+#define WEBSOCK_FLAG_FLUSH (1<<3) //Send right away instead of merging with later writes (TLS write coalescing)
 #define WEBSOCK_CLOSED -1
 
 #ifdef __cplusplus
@@ -20,6 +24,38 @@ typedef void(*WsConnectedCb)(Websock *ws);
 typedef void(*WsRecvCb)(Websock *ws, char *data, int len, int flags);
 typedef void(*WsSentCb)(Websock *ws);
 typedef void(*WsCloseCb)(Websock *ws);
+typedef void(*WsQueueCb)(Websock *ws);
+typedef void(*WsSendDoneCb)(Websock *ws, const char *data, void *arg);
+
+//What happens to a send that doesn't fit in a full outbound queue
+typedef enum
+{
+	WEBSOCK_QUEUE_DROP_OLDEST,      // drop queued messages, oldest first, until it fits
+	WEBSOCK_QUEUE_COALESCE_LATEST,  // drop everything queued, only the latest message matters
+	WEBSOCK_QUEUE_DISCONNECT        // close the connection to the slow client
+} WebsockQueuePolicy;
+
+typedef struct
+{
+	int maxBytes;            // bytes of frames the queue holds at most
+	int highWatermark;       // highCb is called when the queue grows to this many bytes...
+	int lowWatermark;        // ...and lowCb when it has drained to this many again
+	WebsockQueuePolicy policy;
+	WsQueueCb highCb;        // optional
+	WsQueueCb lowCb;         // optional
+} WebsockQueueConfig;
+
+typedef struct WebsockRecvPool WebsockRecvPool;
+
+//Complete message handed to the application by cgiWebsocketSetRecvQueue
+typedef struct {
+	Websock *ws;	// only valid until closeCb of the websocket has returned
+	int flags;		// WEBSOCK_FLAG_BIN for binary messages
+	int len;
+	int size;		// internal: capacity of data
+	WebsockRecvPool *pool;	// internal: where cgiWebsocketMsgFree returns it
+	char data[];	// zero terminated
+} WebsockRecvMsg;
 
 struct Websock {
 	void *userData;
@@ -33,8 +69,84 @@ struct Websock {
 
 CgiStatus cgiWebsocket(HttpdConnData *connData);
 int cgiWebsocketSend(HttpdInstance *pInstance, Websock *ws, const char *data, int len, int flags);
+/**
+ * Send data from a buffer owned by the caller without copying it
+ *
+ * The frame header is written from the stack and the payload straight from data, using one writev().
+ * On a websocket with an outbound queue the queue entry points at data and the payload is written
+ * from there as the socket drains. doneCb(ws, data, arg) is called exactly once when the websocket
+ * is done with the buffer: after it was written, or when it was dropped or failed to send, and
+ * possibly after closeCb. Until then data has to stay valid and unchanged. Called with the server
+ * lock held, possibly before this returns. The payload is never compressed. Returns like
+ * cgiWebsocketSend.
+ */
+int cgiWebsocketSendZeroCopy(HttpdInstance *pInstance, Websock *ws, const char *data, int len, int flags,
+                             WsSendDoneCb doneCb, void *arg);
 void cgiWebsocketClose(HttpdInstance *pInstance, Websock *ws, int reason);
 CgiStatus cgiWebSocketRecv(HttpdInstance *pInstance, HttpdConnData *connData, char *data, int len);
+/**
+ * Deliver complete messages to recvCb instead of fragments
+ *
+ * Frames, continuation frames and data split over several reads are collected in a pooled
+ * buffer and recvCb is called once per message, never with WEBSOCK_FLAG_MORE. Text messages
+ * are zero terminated. A message larger than maxMsgSize closes the websocket with code 1009.
+ * Call from the connected callback; 0 switches reassembly off again.
+ */
+void cgiWebsocketReassemble(Websock *ws, int maxMsgSize);
+/**
+ * Post complete messages to queue instead of calling recvCb
+ *
+ * recvCb runs on the server task with the server lock held, so anything slow in it holds up the
+ * whole server. With a receive queue, each message is reassembled (see cgiWebsocketReassemble),
+ * copied into a pooled WebsockRecvMsg and a pointer to it is posted to queue, which has to be
+ * created with an item size of sizeof(WebsockRecvMsg *). The application task receiving from the
+ * queue owns the message and hands it back with cgiWebsocketMsgFree. Messages are dropped when the
+ * queue is full. msg->ws may have closed by the time the message is handled; track closeCb and
+ * take the server lock before using it. Call from the connected callback; NULL goes back to recvCb.
+ */
+bool cgiWebsocketSetRecvQueue(Websock *ws, QueueHandle_t queue, int maxMsgSize);
+
+/**
+ * Return a message received from a receive queue to the pool. Safe to call from any task.
+ */
+void cgiWebsocketMsgFree(WebsockRecvMsg *msg);
+/**
+ * Compress messages sent on this websocket (the default when permessage-deflate was negotiated,
+ * see CONFIG_ESPHTTPD_WS_DEFLATE). Disable for sockets that mostly carry data that doesn't compress.
+ * Compressed messages from the client are always inflated.
+ */
+void cgiWebsocketSetCompression(Websock *ws, bool enable);
+
+/**
+ * Give the websocket a bounded outbound queue
+ *
+ * Sends, broadcasts, pings and pongs are queued and written as far as the socket takes them
+ * without blocking; the rest goes out as the socket drains, after which sentCb is called.
+ * Broadcasts share one copy of the frame between all queued sockets. When a send doesn't fit,
+ * config->policy decides what gives. The drop policies drop whole frames, so don't combine them
+ * with fragmented sends (WEBSOCK_FLAG_MORE). TLS connections are written with blocking writes.
+ * Pass NULL to write sends out directly again.
+ */
+bool cgiWebsocketSetQueue(HttpdInstance *pInstance, Websock *ws, const WebsockQueueConfig *config);
+
+/**
+ * Bytes waiting in the outbound queue of the websocket
+ */
+int cgiWebsocketQueuedBytes(Websock *ws);
+/**
+ * Ping websockets of pInstance that have been quiet for intervalMs and close the ones that
+ * don't answer within timeoutMs, so clients that vanished stop holding a connection slot and
+ * stop costing broadcast time. Any data from the client counts as an answer.
+ */
+void cgiWebsockKeepaliveStart(HttpdInstance *pInstance, int intervalMs, int timeoutMs);
+void cgiWebsockKeepaliveStop(HttpdInstance *pInstance);
+/**
+ * Send to every websocket connected to resource
+ * Websockets without an outbound queue are written without blocking: one whose socket is full
+ * misses the message, one that only takes part of it is closed. Give subscribers a queue
+ * (cgiWebsocketSetQueue()) when they must not miss messages.
+ * Returns the number of websockets the message was written or queued to
+ */
 int cgiWebsockBroadcast(HttpdInstance *pInstance, const char *resource, char *data, int len, int flags);
 
 #ifdef __cplusplus
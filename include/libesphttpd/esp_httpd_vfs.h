@@ -19,8 +19,28 @@ bool cgiEspVfsBasePath(const char *bp);
 //      ROUTE_CGI("*", cgiEspVfsGet) or
 //      ROUTE_CGI_ARG("*", cgiEspVfsGet, "/base/directory/") or
 //      ROUTE_CGI_ARG("*", cgiEspVfsGet, ".") to use the current working directory
+//
+// Where a url resolves to (path, index.html or .gz variant, size, gzip flag, mime type) is cached,
+// see CONFIG_ESPHTTPD_VFS_CACHE_ENTRIES, so a hot file is opened without stat() calls. Small files
+// can also be kept in RAM whole, see CONFIG_ESPHTTPD_VFS_CONTENT_CACHE_SIZE.
 CgiStatus cgiEspVfsGet(HttpdConnData *connData);
 
+//Drop cached cgiEspVfsGet lookups and contents of the file at path, its .gz variant and, for a
+//directory, everything below it; all of them if path is NULL. cgiEspVfsUpload does this itself; call it after changing served files any other way.
+void cgiEspVfsCacheInvalidate(const char *path);
+
+typedef struct {
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t evictions;
+	int entries;
+	int bytes;		// of the CONFIG_ESPHTTPD_VFS_CONTENT_CACHE_SIZE budget in use
+} EspVfsContentCacheStats;
+
+//Counters of the in-RAM cache of small files cgiEspVfsGet serves without filesystem calls, see
+//CONFIG_ESPHTTPD_VFS_CONTENT_CACHE_SIZE. All zero when the cache is disabled.
+void cgiEspVfsContentCacheStats(EspVfsContentCacheStats *stats);
+
 
 //This is a POST and PUT handler for uploading files to the VFS filesystem.
 // If http method is not PUT or POST, this cgi function returns NOT_FOUND, and then other cgi functions specified later in the routing table can try.
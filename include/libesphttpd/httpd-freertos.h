@@ -4,6 +4,8 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/timers.h"
 
+#include <sys/uio.h>
+
 #include "httpd.h"
 #include "lwip/sockets.h"
 
@@ -17,6 +19,15 @@
     extern "C" {
 #endif
 
+#ifdef CONFIG_ESPHTTPD_SSL_SUPPORT
+typedef enum
+{
+    SslStateEstablished,         // handshake complete (or not started yet)
+    SslStateHandshakeWantRead,   // handshake waiting for the socket to become readable
+    SslStateHandshakeWantWrite   // handshake waiting for the socket to become writable
+} RtosSslState;
+#endif
+
 struct RtosConnType{
     int fd;
     int needWriteDoneNotif;
@@ -25,6 +36,11 @@ struct RtosConnType{
     char ip[4];
 #ifdef CONFIG_ESPHTTPD_SSL_SUPPORT
     SSL *ssl;
+    RtosSslState sslState;
+    TickType_t handshakeDeadline;
+    char *coalesceBuf;              // small writes waiting to go out as one TLS record
+    int coalesceLen;
+    TickType_t coalesceDeadline;
 #endif
 
     // server connection data structure
@@ -35,25 +51,108 @@ typedef struct RtosConnType RtosConnType;
 typedef RtosConnType* ConnTypePtr;
 typedef TimerHandle_t HttpdPlatTimerHandle;
 
+/**
+ * Write all of buff, blocking while the socket is full
+ * Returns len, or a negative value when the connection failed or the peer took nothing
+ * for HTTPD_SEND_TIMEOUT_MS. The connection is unusable after a failed write.
+ */
 int httpdPlatSendData(HttpdInstance *pInstance, HttpdConnData *pConn, char *buff, int len);
 
+/**
+ * Write several buffers in order, as one write where the transport allows it
+ * Blocks while the socket is full like httpdPlatSendData(), so all data is written unless the
+ * connection fails or stalls for HTTPD_SEND_TIMEOUT_MS. At most HTTPD_PLAT_IOV_MAX buffers.
+ * Returns the number of bytes written, or a negative value on error
+ */
+int httpdPlatSendIov(HttpdInstance *pInstance, HttpdConnData *pConn, const struct iovec *iov, int iovcnt);
+
+/**
+ * Write as much of buff as the socket takes right now
+ * Returns the number of bytes written, 0 if the socket is full, or a negative value on error.
+ * The connection gets a sent callback once the socket is writable again, from any task.
+ * TLS connections are written with a blocking write.
+ */
+int httpdPlatSendNonblock(HttpdInstance *pInstance, HttpdConnData *pConn, const char *buff, int len);
+
+/**
+ * httpdPlatSendNonblock() for several buffers, written in order as one write
+ * At most HTTPD_PLAT_IOV_MAX buffers.
+ */
+int httpdPlatSendIovNonblock(HttpdInstance *pInstance, HttpdConnData *pConn, const struct iovec *iov, int iovcnt);
+
+/**
+ * Send data held back by httpdPlatSendData() (TLS write coalescing) right away
+ * Returns 0 on success
+ */
+int httpdPlatFlushData(HttpdInstance *pInstance, HttpdConnData *pConn);
+
 void httpdPlatDisconnect(HttpdConnData *ponn);
+
+/**
+ * Shut the connection down without waiting for pending data to be sent, for peers that
+ * stopped responding. The server task closes it as if the peer had. Call with the lock held.
+ */
+void httpdPlatAbort(HttpdConnData *pConn);
 void httpdPlatDisableTimeout(HttpdConnData *pConn);
 
 void httpdPlatLock(HttpdInstance *pInstance);
 void httpdPlatUnlock(HttpdInstance *pInstance);
 
+/**
+ * Make the server task recompute its select() timeout and write set, for other tasks
+ * that queued data or set a deadline behind its back. Does nothing on the server task.
+ */
+void httpdPlatWake(HttpdInstance *pInstance);
+
+typedef void (*HttpdPlatPostFn)(HttpdInstance *pInstance, void *arg);
+
+/**
+ * Have the server task call fn(pInstance, arg) with the lock held, for work that must not
+ * block the calling task (timer callbacks). Returns false if the call couldn't be queued
+ * (server task not running, HTTPD_PLAT_POST_QUEUE_LEN calls already waiting), fn is not
+ * called then.
+ */
+bool httpdPlatPost(HttpdInstance *pInstance, HttpdPlatPostFn fn, void *arg);
+
 HttpdPlatTimerHandle httpdPlatTimerCreate(const char *name, int periodMs, int autoreload, void (*callback)(void *arg), void *ctx);
+//The ctx passed to httpdPlatTimerCreate(), timer callbacks get their timer handle as argument
+void *httpdPlatTimerGetContext(HttpdPlatTimerHandle timer);
 void httpdPlatTimerStart(HttpdPlatTimerHandle timer);
 void httpdPlatTimerStop(HttpdPlatTimerHandle timer);
 void httpdPlatTimerDelete(HttpdPlatTimerHandle timer);
 
 #ifdef CONFIG_ESPHTTPD_SHUTDOWN_SUPPORT
 void httpdPlatShutdown(HttpdInstance *pInstance);
+void httpdPlatDrain(HttpdInstance *pInstance, int timeoutMs);
 #endif
 
 #define RECV_BUF_SIZE 2048
 
+#define HTTPD_PLAT_IOV_MAX 4
+
+//Calls httpdPlatPost() can have waiting for the server task
+#ifndef HTTPD_PLAT_POST_QUEUE_LEN
+#define HTTPD_PLAT_POST_QUEUE_LEN 8
+#endif
+
+//Time a blocking write waits for the socket to accept more data before failing, in ms.
+//Set as the send timeout (SO_SNDTIMEO) of every client socket.
+#ifndef HTTPD_SEND_TIMEOUT_MS
+#define HTTPD_SEND_TIMEOUT_MS 5000
+#endif
+
+//Time a client gets to complete the TLS handshake before it is disconnected, in ms.
+#ifndef HTTPD_SSL_HANDSHAKE_TIMEOUT_MS
+#define HTTPD_SSL_HANDSHAKE_TIMEOUT_MS 10000
+#endif
+
+typedef struct
+{
+    // Write coalescing, merges small writes into one TLS record, 0 disables
+    int coalesceSize;          // writes smaller than this are held back, up to this many bytes in total
+    int coalesceDelayMs;       // longest a write is held back, 0 sends at the end of the current event
+} HttpdFreertosSslConfig;
+
 typedef struct
 {
     RtosConnType *rconn;
@@ -62,8 +161,16 @@ typedef struct
     struct sockaddr_in httpListenAddress;
     HttpdFlags httpdFlags;
 
+    // loopback udp port the server task listens on for wake ups, which carry no data
+    int udpCtrlPort;
+    int udpCtrlFd;                  // socket other tasks send wake ups from
+    TaskHandle_t serverTask;
+    volatile bool wakePending;      // a wake up is on its way
+    xQueueHandle postQueue;         // calls queued with httpdPlatPost()
+
 #ifdef CONFIG_ESPHTTPD_SHUTDOWN_SUPPORT
-    int udpShutdownPort;
+    TickType_t drainDeadline;
+    volatile bool shutdownRequested;
 #endif
 
     bool isShutdown;
@@ -75,6 +182,7 @@ typedef struct
 
 #ifdef CONFIG_ESPHTTPD_SSL_SUPPORT
     SSL_CTX *ctx;
+    HttpdFreertosSslConfig sslConfig;
 #endif
 
     HttpdInstance httpdInstance;
@@ -158,6 +266,15 @@ typedef enum
  */
 SslInitStatus httpdFreertosSslInit(HttpdFreertosInstance *pInstance);
 
+/**
+ * Configure SSL with explicit settings
+ *
+ * NOTE: Must be called before starting the server if SSL mode is enabled
+ * NOTE: Must be called again after each call to httpdShutdown()
+ */
+SslInitStatus httpdFreertosSslInitEx(HttpdFreertosInstance *pInstance,
+                                     const HttpdFreertosSslConfig *config);
+
 /**
  * Set the ssl certificate and private key (in DER format)
  *
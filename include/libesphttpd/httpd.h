@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <time.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -146,6 +147,7 @@ struct HttpdConnData {
 	cgiRecvHandler recvHdl;	// Handler for data received after headers, if any
 	HttpdPostData post;	// POST data structure
 	bool isConnectionClosed;
+	HttpdInstance *instance;	// Server the connection belongs to
 };
 
 //A struct describing an url. This is the main struct that's used to send different URL requests to
@@ -193,6 +195,15 @@ typedef struct HttpdInstance
 	const HttpdBuiltInUrl *builtInUrls;
 
 	int maxConnections;
+
+	// Set while the server drains for shutdown: new responses are sent with
+	// 'Connection: close' and connections are not kept alive.
+	bool isDraining;
+
+	// Websockets of this server, owned by cgiwebsocket.c and guarded by the instance lock
+	struct WebsockRegistry *websockRegistry;
+	// Frees websockRegistry, set along with it. Called when the server task exits.
+	void (*websockRegistryFree)(struct HttpdInstance *pInstance);
 } HttpdInstance;
 
 typedef enum
@@ -221,14 +232,104 @@ void httpdEndHeaders(HttpdConnData *conn);
 bool httpdGetHeader(HttpdConnData *conn, const char *header, char *ret, int retLen);
 
 int httpdSend(HttpdConnData *conn, const char *data, int len);
+/**
+ * Get room at the end of the send buffer to write response data into in place,
+ * saving the copy httpdSend() does. Fill in at most *len bytes, then call httpdSendCommit()
+ * with the number written before any other send.
+ * Returns NULL, with *len 0, when the buffer is full.
+ */
+char *httpdSendReserve(HttpdConnData *conn, int *len);
+void httpdSendCommit(HttpdConnData *conn, int len);
 int httpdSend_js(HttpdConnData *conn, const char *data, int len);
 int httpdSend_html(HttpdConnData *conn, const char *data, int len);
 void httpdFlushSendBuffer(HttpdInstance *pInstance, HttpdConnData *conn);
+
+/**
+ * Like httpdFlushSendBuffer() but also pushes out data the platform is holding back
+ * to merge with later writes. Use for latency sensitive sends.
+ */
+void httpdFlushSendBufferNow(HttpdInstance *pInstance, HttpdConnData *conn);
+/**
+ * Write data straight to the connection, without copying it into the send buffer first
+ *
+ * Flushes the send buffer, then writes data, framed as one chunk when the response is chunked.
+ * Blocks until written, or until the peer has taken nothing for the platform send timeout
+ * (HTTPD_SEND_TIMEOUT_MS), which fails the connection. For large or long lived responses sent
+ * from outside the CGI, call with the server lock held. len of -1 sends data as a C-string.
+ * Returns 1 on success.
+ */
+int httpdSendDirect(HttpdInstance *pInstance, HttpdConnData *conn, const char *data, int len);
+
+//Body written straight from memory by httpdSendDirectNonblock()
+typedef struct {
+    const char *pos;        // next byte of data to write
+    const char *end;
+    char frame[12];         // chunk head or tail waiting to go out
+    int frameLen;
+    int frameOff;
+    bool tailPending;       // the chunk tail follows the data
+} HttpdDirectSend;
+
+/**
+ * Set up ds to write len bytes of data as the rest of the response body with
+ * httpdSendDirectNonblock(), framed as one chunk when the response is chunked.
+ * Flushes the send buffer. data must stay valid until the send is done.
+ */
+void httpdSendDirectStart(HttpdInstance *pInstance, HttpdConnData *conn, HttpdDirectSend *ds, const char *data, int len);
+/**
+ * Write as much of ds as the socket takes right now without blocking, at most maxLen bytes of
+ * data per call so other connections get their turn. Return HTTPD_CGI_MORE from the CGI while
+ * this returns 0, the sent callback calls it again once the socket has room.
+ * Returns 1 when all of it is written, 0 when there is more, -1 when the write failed; the
+ * connection is shut down then.
+ */
+int httpdSendDirectNonblock(HttpdInstance *pInstance, HttpdConnData *conn, HttpdDirectSend *ds, int maxLen);
 CallbackStatus httpdContinue(HttpdInstance *pInstance, HttpdConnData *conn);
 CallbackStatus httpdConnSendStart(HttpdInstance *pInstance, HttpdConnData *conn);
 void httpdConnSendFinish(HttpdInstance *pInstance, HttpdConnData *conn);
+
+/**
+ * True if the connection has no request in progress: no headers partially received,
+ * no CGI running. Used by the platform code to close idle keep-alive connections
+ * while draining.
+ */
+bool httpdConnIsIdle(HttpdConnData *conn);
 void httpdAddCacheHeaders(HttpdConnData *connData, const char *mime);
 
+/**
+ * Add the validators of a response: the ETag (quoted, NULL for none) and the Last-Modified date
+ * (0 for none). Call between httpdStartResponse() and httpdEndHeaders().
+ */
+void httpdValidatorHeaders(HttpdConnData *conn, const char *etag, time_t lastModified);
+
+/**
+ * True if the request's If-None-Match or If-Modified-Since shows the client's cached copy is
+ * current, so httpdSendNotModified() can answer instead of sending the content.
+ */
+bool httpdIsNotModified(HttpdConnData *conn, const char *etag, time_t lastModified);
+
+/**
+ * Answer 304 Not Modified with the validators and no body. The CGI is done after this.
+ */
+void httpdSendNotModified(HttpdConnData *conn, const char *etag, time_t lastModified);
+
+//Byte range of a resource, end inclusive
+typedef struct {
+	long start;
+	long end;
+} HttpdRange;
+
+/**
+ * Parse the Range header of a GET for a resource of size bytes, taking If-Range into account
+ * with the resource's etag and lastModified (NULL and 0 if it has none).
+ *
+ * Returns the number of ranges stored in ranges, clamped to the resource. 0 means send all of
+ * it: there is no usable Range header, If-Range doesn't match, or there are more than maxRanges.
+ * -1 means none of the ranges is satisfiable, answer 416.
+ */
+int httpdGetRanges(HttpdConnData *conn, long size, const char *etag, time_t lastModified,
+                   HttpdRange *ranges, int maxRanges);
+
 //Platform dependent code should call these.
 CallbackStatus httpdSentCb(HttpdInstance *pInstance, HttpdConnData *pConn);
 CallbackStatus httpdRecvCb(HttpdInstance *pInstance, HttpdConnData *pConn, char *data, unsigned short len);
@@ -243,6 +344,16 @@ void httpdConnectCb(HttpdInstance *pInstance, HttpdConnData *pConn);
 
 #ifdef CONFIG_ESPHTTPD_SHUTDOWN_SUPPORT
 void httpdShutdown(HttpdInstance *pInstance);
+
+/**
+ * Gracefully shut the server down.
+ *
+ * Stops accepting new connections, closes idle keep-alive connections and lets
+ * in-flight requests finish, with 'Connection: close' sent on any response started
+ * from now on. Once all connections are closed, or timeoutMs has elapsed, the
+ * server is torn down like httpdShutdown() does. Blocks until the server has exited.
+ */
+void httpdShutdownDrain(HttpdInstance *pInstance, int timeoutMs);
 #endif
 
 #ifdef __cplusplus
@@ -38,6 +38,12 @@
 /** Websocket endpoint */
 #define ROUTE_WS(path, callback)                   ROUTE_CGI_ARG((path), cgiWebsocket, (WsConnectedCb)(callback))
 
+/** Server-sent events endpoint, stream is a SseStream* */
+#define ROUTE_SSE(path, stream)                    ROUTE_CGI_ARG((path), cgiSse, (SseStream*)(stream))
+
+/** Static files from an asset image, store is a mounted AssetStore* */
+#define ROUTE_ASSETS(path, store)                  ROUTE_CGI_ARG((path), cgiAssets, (AssetStore*)(store))
+
 /** Catch-all filesystem route */
 #define ROUTE_FILESYSTEM()                         ROUTE_CGI("*", cgiEspFsHook)
 
@@ -1,10 +1,24 @@
 #ifndef __SHA1_H__
 #define __SHA1_H__
 
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+
+#ifdef CONFIG_ESPHTTPD_SHA1_MBEDTLS
+#include "mbedtls/sha1.h"
+#endif
+
 #define HASH_LENGTH 20
 #define BLOCK_LENGTH 64
 
 typedef struct sha1nfo {
+#ifdef CONFIG_ESPHTTPD_SHA1_MBEDTLS
+    mbedtls_sha1_context ctx;
+#endif
     uint32_t buffer[BLOCK_LENGTH/4];
     uint32_t state[HASH_LENGTH/4];
     uint32_t byteCount;
@@ -22,6 +36,7 @@ void sha1_init(sha1nfo *s);
  */
 void sha1_writebyte(sha1nfo *s, uint8_t data);
 /**
+ * Hashes whole 64 byte blocks straight from data, only partial blocks are buffered
  */
 void sha1_write(sha1nfo *s, const char *data, size_t len);
 /**
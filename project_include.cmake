@@ -0,0 +1,54 @@
+set(LIBESPHTTPD_MKASSETIMAGE ${CMAKE_CURRENT_LIST_DIR}/tools/mkassetimage.py)
+
+# libesphttpd_create_asset_image
+#
+# Pack base_dir into an asset image for cgiAssets (see include/libesphttpd/cgiassets.h) that fits
+# the data partition named partition. With FLASH_IN_PROJECT it is flashed with 'idf.py flash',
+# otherwise with 'idf.py <partition>-flash'. MIN_SAVING (percent, default 10) and
+# DROP_UNCOMPRESSED are passed on to tools/mkassetimage.py.
+function(libesphttpd_create_asset_image partition base_dir)
+    set(options FLASH_IN_PROJECT DROP_UNCOMPRESSED)
+    set(one MIN_SAVING)
+    set(multi DEPENDS)
+    cmake_parse_arguments(arg "${options}" "${one}" "${multi}" "${ARGN}")
+
+    idf_build_get_property(python PYTHON)
+    get_filename_component(base_dir_full_path ${base_dir} ABSOLUTE)
+
+    set(mkassetimage_args)
+    if(arg_MIN_SAVING)
+        list(APPEND mkassetimage_args --min-saving ${arg_MIN_SAVING})
+    endif()
+    if(arg_DROP_UNCOMPRESSED)
+        list(APPEND mkassetimage_args --drop-uncompressed)
+    endif()
+
+    partition_table_get_partition_info(size "--partition-name ${partition}" "size")
+    partition_table_get_partition_info(offset "--partition-name ${partition}" "offset")
+
+    if("${size}" AND "${offset}")
+        set(image_file ${CMAKE_BINARY_DIR}/${partition}.bin)
+        file(GLOB_RECURSE asset_files ${base_dir_full_path}/*)
+
+        add_custom_command(OUTPUT ${image_file}
+            COMMAND ${python} ${LIBESPHTTPD_MKASSETIMAGE} --size ${size} ${mkassetimage_args}
+                    ${base_dir_full_path} ${image_file}
+            DEPENDS ${asset_files} ${LIBESPHTTPD_MKASSETIMAGE} ${arg_DEPENDS}
+            COMMENT "Packing ${base_dir} into asset image ${partition}.bin"
+            VERBATIM)
+        add_custom_target(assets_${partition}_bin ALL DEPENDS ${image_file})
+
+        set_property(DIRECTORY "${CMAKE_CURRENT_SOURCE_DIR}" APPEND PROPERTY
+            ADDITIONAL_MAKE_CLEAN_FILES ${image_file})
+
+        if(arg_FLASH_IN_PROJECT)
+            esptool_py_flash_project_args(${partition} ${offset} ${image_file} FLASH_IN_PROJECT)
+        else()
+            esptool_py_flash_project_args(${partition} ${offset} ${image_file})
+        endif()
+    else()
+        set(message "Failed to create asset image for partition '${partition}'. "
+                    "Check project configuration if using the correct partition table file.")
+        fail_at_build_time(assets_${partition}_bin "${message}")
+    endif()
+endfunction()
@@ -0,0 +1,169 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+Host test and benchmark for the software SHA-1 in core/sha1.c: FIPS 180 and RFC 2202 (HMAC)
+vectors, random data written in random pieces against the byte at a time path, then the
+throughput of sha1_write() against feeding it a byte at a time.
+
+Run with 'make check' or 'make bench'.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libesphttpd/sha1.h"
+
+#define TEST_ROUNDS 2000
+#define TEST_MAX_LEN 1000
+#define BENCH_LEN 4096
+#define BENCH_BYTES (64L * 1024 * 1024)
+
+typedef struct {
+    const char *data;
+    int repeat;
+    const char *digest;
+} HashVector;
+
+static const HashVector hashVectors[] = {
+    { "", 1, "da39a3ee5e6b4b0d3255bfef95601890afd80709" },
+    { "abc", 1, "a9993e364706816aba3e25717850c26c9cd0d89d" },
+    { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1, "84983e441c3bd26ebaae4aa1f95129e5e54670f1" },
+    { "a", 1000000, "34aa973cd4c4daa4f61eeb2bdbad27316534016f" },
+    // websocket handshake example from RFC 6455
+    { "dGhlIHNhbXBsZSBub25jZQ==258EAFA5-E914-47DA-95CA-C5AB0DC85B11", 1, "b37a4f2cc0624f1690f64606cf385945b2bec4ea" },
+};
+
+typedef struct {
+    uint8_t keyByte;      // key is keyLen copies of keyByte, unless key is set
+    int keyLen;
+    const char *key;
+    uint8_t dataByte;     // data is dataLen copies of dataByte, unless data is set
+    int dataLen;
+    const char *data;
+    const char *digest;
+} HmacVector;
+
+//RFC 2202 section 3
+static const HmacVector hmacVectors[] = {
+    { 0x0b, 20, NULL, 0, 0, "Hi There", "b617318655057264e28bc0b6fb378c8ef146be00" },
+    { 0, 0, "Jefe", 0, 0, "what do ya want for nothing?", "effcdf6ae5eb2fa2d27416d5f184df9c259a7c79" },
+    { 0xaa, 20, NULL, 0xdd, 50, NULL, "125d7342b9ac11cd91a39af48aa17b4f63f175d3" },
+    { 0x0c, 20, NULL, 0, 0, "Test With Truncation", "4c1a03424b55e07fe7f27be1d58bb9324a9a5a04" },
+    { 0xaa, 80, NULL, 0, 0, "Test Using Larger Than Block-Size Key - Hash Key First", "aa4ae5e15272d00e95705637ce8a3b55ed402112" },
+    { 0xaa, 80, NULL, 0, 0, "Test Using Larger Than Block-Size Key and Larger Than One Block-Size Data", "e8e99d0f45237d786d6bbaa7965c7808bbff1a91" },
+};
+
+static int checkDigest(const char *what, const uint8_t *digest, const char *expected) {
+    char hex[HASH_LENGTH * 2 + 1];
+    for (int i = 0; i < HASH_LENGTH; i++) sprintf(&hex[i * 2], "%02x", digest[i]);
+    if (strcmp(hex, expected) != 0) {
+        printf("FAIL %s: got %s, expected %s\n", what, hex, expected);
+        return 1;
+    }
+    return 0;
+}
+
+static int testVectors(void) {
+    int failures = 0;
+    sha1nfo s;
+
+    for (int v = 0; v < (int)(sizeof(hashVectors) / sizeof(hashVectors[0])); v++) {
+        sha1_init(&s);
+        for (int r = 0; r < hashVectors[v].repeat; r++) {
+            sha1_write(&s, hashVectors[v].data, strlen(hashVectors[v].data));
+        }
+        char what[32];
+        snprintf(what, sizeof(what), "hash vector %d", v);
+        failures += checkDigest(what, sha1_result(&s), hashVectors[v].digest);
+    }
+
+    for (int v = 0; v < (int)(sizeof(hmacVectors) / sizeof(hmacVectors[0])); v++) {
+        const HmacVector *hv = &hmacVectors[v];
+        uint8_t key[128], data[128];
+        int keyLen = hv->key ? (int)strlen(hv->key) : hv->keyLen;
+        int dataLen = hv->data ? (int)strlen(hv->data) : hv->dataLen;
+        if (hv->key) memcpy(key, hv->key, keyLen); else memset(key, hv->keyByte, keyLen);
+        if (hv->data) memcpy(data, hv->data, dataLen); else memset(data, hv->dataByte, dataLen);
+
+        sha1_initHmac(&s, key, keyLen);
+        sha1_write(&s, (const char *)data, dataLen);
+        char what[32];
+        snprintf(what, sizeof(what), "hmac vector %d", v);
+        failures += checkDigest(what, sha1_resultHmac(&s), hv->digest);
+    }
+    return failures;
+}
+
+//Random data hashed in random pieces must match the byte at a time path
+static int testRandomSplits(void) {
+    static char data[TEST_MAX_LEN];
+    int failures = 0;
+
+    for (int round = 0; round < TEST_ROUNDS; round++) {
+        int len = rand() % TEST_MAX_LEN;
+        for (int i = 0; i < len; i++) data[i] = rand();
+
+        sha1nfo ref, s;
+        uint8_t refDigest[HASH_LENGTH];
+        sha1_init(&ref);
+        for (int i = 0; i < len; i++) sha1_writebyte(&ref, data[i]);
+        memcpy(refDigest, sha1_result(&ref), HASH_LENGTH);
+
+        sha1_init(&s);
+        int pos = 0;
+        while (pos < len) {
+            // mix single bytes with pieces that leave the block buffer part full
+            int piece = (rand() & 3) ? 1 + rand() % (len - pos) : 1;
+            if (piece == 1 && (rand() & 1)) {
+                sha1_writebyte(&s, data[pos]);
+            } else {
+                sha1_write(&s, &data[pos], piece);
+            }
+            pos += piece;
+        }
+        if (memcmp(sha1_result(&s), refDigest, HASH_LENGTH) != 0) {
+            printf("FAIL random round %d, len %d\n", round, len);
+            if (++failures > 10) break;
+        }
+    }
+    return failures;
+}
+
+static double bench(int byteAtATime) {
+    static char buf[BENCH_LEN];
+    struct timespec start, end;
+    sha1nfo s;
+
+    memset(buf, 0x5a, sizeof(buf));
+    sha1_init(&s);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long done = 0; done < BENCH_BYTES; done += BENCH_LEN) {
+        if (byteAtATime) {
+            for (int i = 0; i < BENCH_LEN; i++) sha1_writebyte(&s, buf[i]);
+        } else {
+            sha1_write(&s, buf, BENCH_LEN);
+        }
+    }
+    sha1_result(&s);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return BENCH_BYTES / secs / (1024 * 1024);
+}
+
+int main(int argc, char **argv) {
+    srand(argc > 2 ? atoi(argv[2]) : 1);
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        printf("sha1: byte at a time %.0f MB/s, sha1_write %.0f MB/s\n", bench(1), bench(0));
+        return 0;
+    }
+
+    int failures = testVectors() + testRandomSplits();
+    printf("sha1: vectors and %d random rounds, %d failures\n", TEST_ROUNDS, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1 @@
+/* Empty stand-in for the ESP-IDF header, for host builds */
@@ -0,0 +1,95 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+Host test and benchmark for websockUnmask(): random lengths, alignments, mask positions and
+splits against the byte at a time reference, then the throughput of both.
+
+Run with 'make check' or 'make bench'.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "websock_unmask.h"
+
+#define TEST_ROUNDS 20000
+#define TEST_MAX_LEN 300
+#define BENCH_LEN (64 * 1024)
+#define BENCH_BYTES (256L * 1024 * 1024)
+
+//The implementation the word at a time version replaced
+static void unmaskReference(char *data, int len, const uint8_t *mask, uint8_t *maskCtr) {
+    for (int i = 0; i < len; i++) {
+        data[i] ^= mask[((*maskCtr)++)&3];
+    }
+}
+
+static int testRandom(void) {
+    // room for the largest offset plus guard bytes on both ends
+    uint8_t buf[TEST_MAX_LEN + 32], ref[TEST_MAX_LEN + 32];
+    int failures = 0;
+
+    for (int round = 0; round < TEST_ROUNDS; round++) {
+        uint8_t mask[4];
+        for (int i = 0; i < 4; i++) mask[i] = rand();
+        for (int i = 0; i < (int)sizeof(buf); i++) buf[i] = ref[i] = rand();
+
+        int offset = 8 + rand() % 16;
+        int len = rand() % TEST_MAX_LEN;
+        uint8_t ctr = rand(), refCtr = ctr;
+
+        // unmask in random pieces, the way payloads arrive split over recv() calls
+        int pos = 0;
+        while (pos < len) {
+            int piece = 1 + rand() % (len - pos);
+            websockUnmask((char *)&buf[offset + pos], piece, mask, &ctr);
+            pos += piece;
+        }
+        unmaskReference((char *)&ref[offset], len, mask, &refCtr);
+
+        if (memcmp(buf, ref, sizeof(buf)) != 0 || (ctr & 3) != (refCtr & 3)) {
+            printf("FAIL round %d: offset %d, len %d\n", round, offset, len);
+            if (++failures > 10) break;
+        }
+    }
+    return failures;
+}
+
+static double bench(void (*fn)(char *, int, const uint8_t *, uint8_t *), int offset) {
+    static char buf[BENCH_LEN + 8];
+    const uint8_t mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+    uint8_t ctr = 0;
+    struct timespec start, end;
+
+    memset(buf, 0x5a, sizeof(buf));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long done = 0; done < BENCH_BYTES; done += BENCH_LEN) {
+        fn(buf + offset, BENCH_LEN, mask, &ctr);
+        __asm__ __volatile__("" : : "r"(buf) : "memory");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return BENCH_BYTES / secs / (1024 * 1024);
+}
+
+int main(int argc, char **argv) {
+    srand(argc > 2 ? atoi(argv[2]) : 1);
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        for (int offset = 0; offset < 2; offset++) {
+            printf("unmask %s buffer: reference %.0f MB/s, word at a time %.0f MB/s\n",
+                    offset ? "unaligned" : "aligned",
+                    bench(unmaskReference, offset), bench(websockUnmask, offset));
+        }
+        return 0;
+    }
+
+    int failures = testRandom();
+    printf("unmask: %d random rounds, %d failures\n", TEST_ROUNDS, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,172 @@
+#!/usr/bin/env python3
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#
+# Pack a directory of web assets into an image for cgiAssets, see include/libesphttpd/cgiassets.h
+# for the layout. Each file is stored as is and, where that saves enough, gzip and brotli
+# compressed; brotli needs the python brotli module and is skipped without it.
+#
+# Usage: mkassetimage.py [--size N] [--min-saving PCT] [--drop-uncompressed] <dir> <image>
+
+import argparse
+import gzip
+import hashlib
+import mimetypes
+import os
+import struct
+import sys
+
+try:
+    import brotli
+except ImportError:
+    brotli = None
+
+ASSET_IMAGE_MAGIC = 0x53414845
+ASSET_IMAGE_VERSION = 2
+
+ENC_BR, ENC_GZIP, ENC_IDENTITY = range(3)
+ENC_SUFFIX = {ENC_BR: '-br', ENC_GZIP: '-gz', ENC_IDENTITY: ''}
+
+HEADER = struct.Struct('<IHHIII')
+VARIANT = struct.Struct('<III')
+ENTRY_HEAD = struct.Struct('<IIII')
+ENTRY_SIZE = ENTRY_HEAD.size + 3 * VARIANT.size
+
+# Same types httpdGetMimetype() gives, anything else is left to the mimetypes module
+MIME_TYPES = {
+    'htm': 'text/html', 'html': 'text/html', 'css': 'text/css', 'js': 'text/javascript',
+    'txt': 'text/plain', 'jpg': 'image/jpeg', 'jpeg': 'image/jpeg', 'png': 'image/png',
+    'svg': 'image/svg+xml', 'xml': 'text/xml', 'json': 'application/json',
+}
+
+
+def fnv1a(data):
+    h = 2166136261
+    for b in data:
+        h = ((h ^ b) * 16777619) & 0xffffffff
+    return h
+
+
+def mimetype(path):
+    ext = path.rsplit('.', 1)[-1].lower() if '.' in os.path.basename(path) else ''
+    if ext in MIME_TYPES:
+        return MIME_TYPES[ext]
+    return mimetypes.guess_type(path)[0] or 'text/html'
+
+
+def variants(data, min_saving, drop_uncompressed):
+    """Encodings worth storing: a compressed variant must save min_saving percent over the
+    next larger one it would be picked instead of"""
+    found = {ENC_IDENTITY: data}
+    gz = gzip.compress(data, compresslevel=9, mtime=0)
+    if len(gz) * 100 <= len(data) * (100 - min_saving):
+        found[ENC_GZIP] = gz
+    if brotli is not None:
+        br = brotli.compress(data, quality=11)
+        smallest = len(found.get(ENC_GZIP, data))
+        if len(br) * 100 <= smallest * (100 - min_saving):
+            found[ENC_BR] = br
+    if drop_uncompressed and len(found) > 1:
+        del found[ENC_IDENTITY]
+    return found
+
+
+def collect(base_dir):
+    files = []
+    for root, dirs, names in os.walk(base_dir):
+        dirs.sort()
+        for name in sorted(names):
+            full = os.path.join(root, name)
+            url = '/' + os.path.relpath(full, base_dir).replace(os.sep, '/')
+            files.append((url, full))
+    return files
+
+
+def build(base_dir, min_saving, drop_uncompressed):
+    files = collect(base_dir)
+    slot_count = 1
+    while slot_count <= len(files) * 2:
+        slot_count *= 2
+
+    strings = bytearray()
+    string_offsets = {}
+    data = bytearray()
+    entries = []
+    slots = [0] * slot_count
+    table_end = HEADER.size + 4 * slot_count + ENTRY_SIZE * len(files)
+
+    def add_string(s):
+        if s not in string_offsets:
+            string_offsets[s] = len(strings)
+            strings.extend(s.encode('utf-8') + b'\0')
+        return string_offsets[s]
+
+    for index, (url, full) in enumerate(files):
+        with open(full, 'rb') as f:
+            content = f.read()
+        name = url.encode('utf-8')
+        h = fnv1a(name)
+        slot = h & (slot_count - 1)
+        while slots[slot]:
+            slot = (slot + 1) & (slot_count - 1)
+        slots[slot] = index + 1
+
+        etag = hashlib.sha1(content).hexdigest()[:16]
+        found = variants(content, min_saving, drop_uncompressed)
+        flags = 0
+        vs = []
+        for enc in (ENC_BR, ENC_GZIP, ENC_IDENTITY):
+            if enc in found:
+                flags |= 1 << enc
+                vs.append((len(data), len(found[enc]), add_string('"%s%s"' % (etag, ENC_SUFFIX[enc]))))
+                data.extend(found[enc])
+            else:
+                vs.append((0, 0, 0))
+        entries.append((h, add_string(url), add_string(mimetype(url)), flags, vs))
+        print('%-40s %8d -> %s' % (url, len(content),
+              ', '.join('%s %d' % (('br', 'gzip', 'identity')[e], len(found[e])) for e in sorted(found))))
+
+    strings_start = table_end
+    data_start = strings_start + len(strings)
+    out = bytearray()
+    image_len = data_start + len(data)
+    out += HEADER.pack(ASSET_IMAGE_MAGIC, ASSET_IMAGE_VERSION, 0, image_len, len(files), slot_count)
+    out += struct.pack('<%dI' % slot_count, *slots)
+    for h, name, mime, flags, vs in entries:
+        out += ENTRY_HEAD.pack(h, strings_start + name, strings_start + mime, flags)
+        for (offset, size, etag), present in zip(vs, (flags >> e & 1 for e in range(3))):
+            if present:
+                out += VARIANT.pack(data_start + offset, size, strings_start + etag)
+            else:
+                out += VARIANT.pack(0, 0, 0)
+    out += strings
+    out += data
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Pack a directory into a libesphttpd asset image')
+    parser.add_argument('base_dir', help='directory to pack, it becomes the root url')
+    parser.add_argument('image', help='image file to write')
+    parser.add_argument('--size', type=lambda x: int(x, 0), default=0,
+                        help='fail if the image is larger than this, e.g. the partition size')
+    parser.add_argument('--min-saving', type=int, default=10,
+                        help='percent a compressed variant has to save to be stored (default 10)')
+    parser.add_argument('--drop-uncompressed', action='store_true',
+                        help='leave out the file as is where a compressed variant is stored')
+    args = parser.parse_args()
+
+    if brotli is None:
+        print('python brotli module not found, storing no brotli variants', file=sys.stderr)
+    image = build(args.base_dir, args.min_saving, args.drop_uncompressed)
+    if args.size and len(image) > args.size:
+        sys.exit('Image is %d bytes, more than the %d available' % (len(image), args.size))
+    with open(args.image, 'wb') as f:
+        f.write(image)
+    print('%s: %d bytes' % (args.image, len(image)))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,315 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+Static files from a read-only asset image, mapped into memory. See cgiassets.h for the image layout.
+*/
+
+#include <libesphttpd/esp.h>
+#include <libesphttpd/httpd-freertos.h>
+#include "libesphttpd/httpd.h"
+#include "libesphttpd/cgiassets.h"
+
+#include <stdio.h>
+
+#include "esp_log.h"
+#include "esp_partition.h"
+#ifdef CONFIG_IDF_TARGET_LINUX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+const static char* TAG = "cgiassets";
+
+//Longest path looked up, including an appended index.html
+#ifndef CGI_ASSETS_MAX_PATH
+#define CGI_ASSETS_MAX_PATH 128
+#endif
+
+//Most file bytes offered to the socket per cgi call. Writes don't block: whatever the socket
+//doesn't take goes out from the sent callback, so other connections get served in between.
+#ifndef CGI_ASSETS_SLICE_LEN
+#define CGI_ASSETS_SLICE_LEN 4096
+#endif
+
+enum {
+    ASSET_MAPPING_NONE,
+    ASSET_MAPPING_PARTITION,
+    ASSET_MAPPING_FILE,
+};
+
+typedef struct {
+    HttpdDirectSend direct; // of the file data in the mapped image
+} AssetSendState;
+
+uint32_t MEM_ATTR cgiAssetsHash(const char *path) {
+    uint32_t hash = 2166136261u;
+    while (*path) {
+        hash ^= (uint8_t)*path++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+//Whether a zero-terminated string starts at offset
+static bool MEM_ATTR assetString(const uint8_t *image, uint32_t len, uint32_t offset) {
+    return offset < len && memchr(&image[offset], 0, len - offset) != NULL;
+}
+
+//Check the layout once, so lookups and sends can trust the offsets
+bool MEM_ATTR cgiAssetsMountImage(AssetStore *store, const void *image, size_t len) {
+    const AssetImageHeader *hdr = image;
+    memset(store, 0, sizeof(AssetStore));
+    if (len < sizeof(AssetImageHeader) || hdr->magic != ASSET_IMAGE_MAGIC) {
+        ESP_LOGE(TAG, "No asset image found");
+        return false;
+    }
+    if (hdr->version != ASSET_IMAGE_VERSION) {
+        ESP_LOGE(TAG, "Asset image version %d, expected %d", hdr->version, ASSET_IMAGE_VERSION);
+        return false;
+    }
+    uint64_t indexEnd = sizeof(AssetImageHeader) + (uint64_t)hdr->slotCount * sizeof(uint32_t) +
+                        (uint64_t)hdr->fileCount * sizeof(AssetImageEntry);
+    if (hdr->imageLen > len || indexEnd > hdr->imageLen || hdr->slotCount == 0 ||
+        (hdr->slotCount & (hdr->slotCount - 1)) != 0 || hdr->fileCount >= hdr->slotCount) {
+        ESP_LOGE(TAG, "Asset image index is corrupt");
+        return false;
+    }
+
+    const uint8_t *base = image;
+    const uint32_t *slots = (const uint32_t *)&base[sizeof(AssetImageHeader)];
+    const AssetImageEntry *entries = (const AssetImageEntry *)&slots[hdr->slotCount];
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < hdr->slotCount; i++) {
+        if (slots[i] > hdr->fileCount) {
+            ESP_LOGE(TAG, "Asset image slot %u is corrupt", (unsigned)i);
+            return false;
+        }
+        if (slots[i] != 0) used++;
+    }
+    // lookups stop at an empty slot
+    if (used == hdr->slotCount) {
+        ESP_LOGE(TAG, "Asset image index is full");
+        return false;
+    }
+    for (uint32_t i = 0; i < hdr->fileCount; i++) {
+        const AssetImageEntry *e = &entries[i];
+        bool ok = assetString(base, hdr->imageLen, e->nameOffset) && assetString(base, hdr->imageLen, e->mimeOffset) &&
+                  (e->flags & ((1 << ASSET_ENCODING_COUNT) - 1)) != 0;
+        for (int enc = 0; ok && enc < ASSET_ENCODING_COUNT; enc++) {
+            const AssetImageVariant *v = &e->variants[enc];
+            if (!(e->flags & ASSET_FLAG_VARIANT(enc))) continue;
+            ok = v->dataOffset <= hdr->imageLen && v->size <= hdr->imageLen - v->dataOffset &&
+                 assetString(base, hdr->imageLen, v->etagOffset);
+        }
+        if (!ok) {
+            ESP_LOGE(TAG, "Asset image entry %u is corrupt", (unsigned)i);
+            return false;
+        }
+    }
+
+    store->image = base;
+    store->len = hdr->imageLen;
+    store->slots = slots;
+    store->entries = entries;
+    ESP_LOGI(TAG, "Mounted %u assets, %u bytes", (unsigned)hdr->fileCount, (unsigned)hdr->imageLen);
+    return true;
+}
+
+bool MEM_ATTR cgiAssetsMountPartition(AssetStore *store, const char *label) {
+    AssetImageHeader hdr;
+    const void *image;
+    spi_flash_mmap_handle_t handle;
+
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    if (part == NULL) {
+        ESP_LOGE(TAG, "No partition %s", label);
+        return false;
+    }
+    // map only as much as the image takes, the MMU has few pages to spare
+    if (esp_partition_read(part, 0, &hdr, sizeof(hdr)) != ESP_OK || hdr.magic != ASSET_IMAGE_MAGIC ||
+        hdr.imageLen > part->size) {
+        ESP_LOGE(TAG, "No asset image in partition %s", label);
+        return false;
+    }
+    if (esp_partition_mmap(part, 0, hdr.imageLen, SPI_FLASH_MMAP_DATA, &image, &handle) != ESP_OK) {
+        ESP_LOGE(TAG, "Can't map partition %s", label);
+        return false;
+    }
+    if (!cgiAssetsMountImage(store, image, hdr.imageLen)) {
+        spi_flash_munmap(handle);
+        return false;
+    }
+    store->mapping = ASSET_MAPPING_PARTITION;
+    store->mapHandle = handle;
+    return true;
+}
+
+#ifdef CONFIG_IDF_TARGET_LINUX
+bool MEM_ATTR cgiAssetsMountFile(AssetStore *store, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        ESP_LOGE(TAG, "Can't open %s", path);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    void *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        ESP_LOGE(TAG, "Can't map %s", path);
+        return false;
+    }
+    if (!cgiAssetsMountImage(store, image, st.st_size)) {
+        munmap(image, st.st_size);
+        return false;
+    }
+    // unmap all of the file, not just the image
+    store->mapping = ASSET_MAPPING_FILE;
+    store->mapHandle = st.st_size;
+    return true;
+}
+#endif
+
+void MEM_ATTR cgiAssetsUnmount(AssetStore *store) {
+    if (store->mapping == ASSET_MAPPING_PARTITION) {
+        spi_flash_munmap(store->mapHandle);
+#ifdef CONFIG_IDF_TARGET_LINUX
+    } else if (store->mapping == ASSET_MAPPING_FILE) {
+        munmap((void *)store->image, store->mapHandle);
+#endif
+    }
+    memset(store, 0, sizeof(AssetStore));
+}
+
+const AssetImageEntry* MEM_ATTR cgiAssetsFind(const AssetStore *store, const char *path) {
+    if (store->image == NULL) return NULL;
+    const AssetImageHeader *hdr = (const AssetImageHeader *)store->image;
+    uint32_t hash = cgiAssetsHash(path);
+    uint32_t mask = hdr->slotCount - 1;
+    // mounting made sure there is an empty slot, so this ends
+    for (uint32_t slot = hash & mask; store->slots[slot] != 0; slot = (slot + 1) & mask) {
+        const AssetImageEntry *e = &store->entries[store->slots[slot] - 1];
+        if (e->hash == hash && strcmp((const char *)&store->image[e->nameOffset], path) == 0) return e;
+    }
+    return NULL;
+}
+
+static const char *assetEncodingNames[ASSET_ENCODING_COUNT] = {"br", "gzip", "identity"};
+
+//Whether the Accept-Encoding list has coding in it, not ruled out with q=0
+static bool MEM_ATTR assetAccepts(const char *acceptEncoding, const char *coding) {
+    int codingLen = strlen(coding);
+    const char *p = acceptEncoding;
+    while (*p) {
+        while (*p == ' ' || *p == ',') p++;
+        const char *token = p;
+        while (*p && *p != ',' && *p != ';' && *p != ' ') p++;
+        bool match = (p - token == codingLen && strncasecmp(token, coding, codingLen) == 0) ||
+                     (p - token == 1 && *token == '*');
+        const char *params = p;
+        while (*p && *p != ',') p++;
+        if (match) {
+            const char *q = strstr(params, "q=");
+            return !(q != NULL && q < p && strtod(q + 2, NULL) == 0);
+        }
+    }
+    return false;
+}
+
+//Smallest variant of e the client takes, ASSET_ENCODING_COUNT if none
+static AssetEncoding MEM_ATTR assetPickEncoding(HttpdConnData *connData, const AssetImageEntry *e) {
+    char acceptEncoding[64];
+    if (!httpdGetHeader(connData, "Accept-Encoding", acceptEncoding, sizeof(acceptEncoding))) {
+        acceptEncoding[0] = '\0';
+    }
+    for (int enc = 0; enc < ASSET_ENCODING_IDENTITY; enc++) {
+        if ((e->flags & ASSET_FLAG_VARIANT(enc)) && assetAccepts(acceptEncoding, assetEncodingNames[enc])) return enc;
+    }
+    // only an explicit identity;q=0 refuses the file as is, not worth parsing for
+    return (e->flags & ASSET_FLAG_VARIANT(ASSET_ENCODING_IDENTITY)) ? ASSET_ENCODING_IDENTITY : ASSET_ENCODING_COUNT;
+}
+
+CgiStatus MEM_ATTR cgiAssets(HttpdConnData *connData) {
+    const AssetStore *store = connData->cgiArg;
+    AssetSendState *state = connData->cgiData;
+    char path[CGI_ASSETS_MAX_PATH];
+
+    if (connData->isConnectionClosed) {
+        //Connection aborted. Clean up.
+        free(state);
+        return HTTPD_CGI_DONE;
+    }
+
+    //First call to this cgi.
+    if (state == NULL) {
+        if (connData->requestType != HTTPD_METHOD_GET) {
+            return HTTPD_CGI_NOTFOUND;
+        }
+        int len = snprintf(path, sizeof(path), "%s", connData->url);
+        if (len > 0 && len < sizeof(path) && path[len - 1] == '/') {
+            len += snprintf(&path[len], sizeof(path) - len, "index.html");
+        }
+        if (len >= sizeof(path)) {
+            return HTTPD_CGI_NOTFOUND;
+        }
+        const AssetImageEntry *e = cgiAssetsFind(store, path);
+        if (e == NULL) {
+            return HTTPD_CGI_NOTFOUND;
+        }
+
+        AssetEncoding enc = assetPickEncoding(connData, e);
+        if (enc == ASSET_ENCODING_COUNT) {
+            ESP_LOGE(TAG, "client accepts none of the encodings of %s", path);
+            httpdStartResponse(connData, 406);
+            httpdEndHeaders(connData);
+            httpdSend(connData, "Your browser does not accept the encoding of this file.\r\n", -1);
+            return HTTPD_CGI_DONE;
+        }
+        const AssetImageVariant *v = &e->variants[enc];
+        const char *etag = (const char *)&store->image[v->etagOffset];
+        if (httpdIsNotModified(connData, etag, 0)) {
+            // headers of the cached copy not repeated here stay as they were
+            httpdSendNotModified(connData, etag, 0);
+            return HTTPD_CGI_DONE;
+        }
+
+        state = malloc(sizeof(AssetSendState));
+        if (state == NULL) {
+            ESP_LOGE(TAG, "Can't allocate mem for send state");
+            return HTTPD_CGI_DONE;
+        }
+        connData->cgiData = state;
+
+        const char *mimetype = (const char *)&store->image[e->mimeOffset];
+        httpdStartResponse(connData, 200);
+        httpdHeader(connData, "Content-Type", mimetype);
+        if (enc != ASSET_ENCODING_IDENTITY) {
+            httpdHeader(connData, "Content-Encoding", assetEncodingNames[enc]);
+        }
+        if (e->flags != ASSET_FLAG_VARIANT(enc)) {
+            // caches must not hand this variant to clients that asked for another
+            httpdHeader(connData, "Vary", "Accept-Encoding");
+        }
+        httpdValidatorHeaders(connData, etag, 0);
+        httpdAddCacheHeaders(connData, mimetype);
+        httpdEndHeaders(connData);
+        // headers first, the body is written to the socket directly from here on
+        httpdSendDirectStart(connData->instance, connData, &state->direct,
+                             (const char *)&store->image[v->dataOffset], v->size);
+    }
+
+    // Straight from the mapped image onto the socket, as much as it takes without blocking
+    int r = httpdSendDirectNonblock(connData->instance, connData, &state->direct, CGI_ASSETS_SLICE_LEN);
+    if (r < 0) ESP_LOGE(TAG, "Sending %s failed", connData->url);
+    if (r != 0) {
+        free(state);
+        connData->cgiData = NULL;
+        return HTTPD_CGI_DONE;
+    }
+    // the sent callback calls us again once the socket has room
+    return HTTPD_CGI_MORE;
+}
@@ -0,0 +1,259 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+Server-sent events support for esphttpd. See https://html.spec.whatwg.org/multipage/server-sent-events.html
+*/
+
+#include <libesphttpd/esp.h>
+#include <libesphttpd/httpd-freertos.h>
+#include "libesphttpd/httpd.h"
+#include "libesphttpd/cgisse.h"
+
+#include <stdio.h>
+
+#include "esp_log.h"
+
+const static char* TAG = "cgisse";
+
+typedef struct SseClient SseClient;
+
+//Formatted event, as it goes out on the wire
+typedef struct {
+    uint32_t id;
+    int len;
+    char data[];
+} SseEvent;
+
+struct SseClient {
+    HttpdConnData *conn;
+    SseClient *next;
+};
+
+struct SseStreamPriv {
+    HttpdInstance *pInstance;
+    HttpdPlatTimerHandle heartbeatTimer; // runs while there are clients
+    SseClient *clients;
+    uint32_t lastId;
+    SseEvent **history; // ring of historySize events, oldest at historyHead
+    int historyHead;
+    int historyCount;
+};
+
+//Set up the private state of stream on first use. Call with the lock held.
+static SseStreamPriv* MEM_ATTR sseStreamPriv(HttpdInstance *pInstance, SseStream *stream) {
+    if (stream->priv == NULL) {
+        SseStreamPriv *priv = malloc(sizeof(SseStreamPriv));
+        if (priv == NULL) return NULL;
+        memset(priv, 0, sizeof(SseStreamPriv));
+        priv->pInstance = pInstance;
+        if (stream->historySize > 0) {
+            priv->history = calloc(stream->historySize, sizeof(SseEvent *));
+            if (priv->history == NULL) {
+                free(priv);
+                return NULL;
+            }
+        }
+        stream->priv = priv;
+    }
+    return stream->priv;
+}
+
+//Format an event: id and event lines, one data line per line of data and the terminating blank line.
+//data lines end in \r\n, \r or \n, like the lines of the stream itself; event must be a single line.
+static SseEvent* MEM_ATTR sseEventNew(uint32_t id, const char *event, const char *data) {
+    int lines = 1;
+    for (const char *p = data; *p; p++) {
+        if (*p == '\n' || (*p == '\r' && p[1] != '\n')) lines++;
+    }
+    int size = 16 + (event ? 8 + strlen(event) : 0) + strlen(data) + lines * 7 + 2;
+    SseEvent *ev = malloc(sizeof(SseEvent) + size);
+    if (ev == NULL) return NULL;
+
+    ev->id = id;
+    ev->len = sprintf(ev->data, "id: %u\n", (unsigned)id);
+    if (event) ev->len += sprintf(&ev->data[ev->len], "event: %s\n", event);
+    const char *line = data;
+    while (1) {
+        int lineLen = strcspn(line, "\r\n");
+        memcpy(&ev->data[ev->len], "data: ", 6);
+        ev->len += 6;
+        memcpy(&ev->data[ev->len], line, lineLen);
+        ev->len += lineLen;
+        ev->data[ev->len++] = '\n';
+        if (line[lineLen] == '\0') break;
+        // a \r\n line end counts as one
+        line += (line[lineLen] == '\r' && line[lineLen + 1] == '\n') ? lineLen + 2 : lineLen + 1;
+    }
+    ev->data[ev->len++] = '\n';
+    return ev;
+}
+
+//Send the events the client missed since lastEventId
+static void MEM_ATTR sseReplay(HttpdInstance *pInstance, HttpdConnData *connData, SseStreamPriv *priv, uint32_t lastEventId) {
+    int historySize = ((SseStream *)connData->cgiArg)->historySize;
+    for (int i = 0; i < priv->historyCount; i++) {
+        SseEvent *ev = priv->history[(priv->historyHead + i) % historySize];
+        // ids count up; an id from the future means the server restarted, so send everything
+        if (lastEventId <= priv->lastId && ev->id <= lastEventId) continue;
+        if (!httpdSendDirect(pInstance, connData, ev->data, ev->len)) {
+            ESP_LOGE(TAG, "Replay of event %u failed", (unsigned)ev->id);
+            break;
+        }
+    }
+}
+
+//Write a comment line to every client, so the ones that vanished fail a write and get closed.
+//Runs on the server task, posted by sseHeartbeatTimerCb.
+static void MEM_ATTR sseHeartbeat(HttpdInstance *pInstance, void *arg) {
+    SseStreamPriv *priv = ((SseStream *)arg)->priv;
+    // the last client may have left since the heartbeat was posted
+    if (priv->heartbeatTimer == NULL) return;
+
+    for (SseClient *client = priv->clients; client != NULL; client = client->next) {
+        if (client->conn->isConnectionClosed) continue;
+        if (!httpdSendDirect(pInstance, client->conn, ":\n\n", 3)) {
+            ESP_LOGW(TAG, "Heartbeat didn't go out, closing the client");
+            httpdPlatAbort(client->conn);
+        }
+    }
+}
+
+//Runs on the timer task, which must not block on the lock or on sockets
+static void MEM_ATTR sseHeartbeatTimerCb(void *arg) {
+    SseStream *stream = httpdPlatTimerGetContext((HttpdPlatTimerHandle)arg);
+    httpdPlatPost(stream->priv->pInstance, sseHeartbeat, stream);
+}
+
+//Start the heartbeat with the first client, stop it when the last one leaves. Call with the lock held.
+static void MEM_ATTR sseHeartbeatUpdate(SseStream *stream) {
+    SseStreamPriv *priv = stream->priv;
+    if (priv->clients != NULL && priv->heartbeatTimer == NULL && stream->heartbeatMs > 0) {
+        priv->heartbeatTimer = httpdPlatTimerCreate("sseheartbeat", stream->heartbeatMs, 1, sseHeartbeatTimerCb, stream);
+        if (priv->heartbeatTimer == NULL) {
+            ESP_LOGE(TAG, "Can't create heartbeat timer");
+        } else {
+            httpdPlatTimerStart(priv->heartbeatTimer);
+        }
+    } else if (priv->clients == NULL && priv->heartbeatTimer != NULL) {
+        httpdPlatTimerStop(priv->heartbeatTimer);
+        httpdPlatTimerDelete(priv->heartbeatTimer);
+        priv->heartbeatTimer = NULL;
+    }
+}
+
+CgiStatus MEM_ATTR cgiSse(HttpdConnData *connData) {
+    SseStream *stream = (SseStream *)connData->cgiArg;
+    SseClient *client = (SseClient *)connData->cgiData;
+    char buff[24];
+
+    if (connData->isConnectionClosed) {
+        // Connection aborted. Unsubscribe and clean up.
+        if (client) {
+            SseClient **pClient = &stream->priv->clients;
+            while (*pClient != NULL && *pClient != client) pClient = &(*pClient)->next;
+            if (*pClient) *pClient = client->next;
+            free(client);
+            connData->cgiData = NULL;
+            sseHeartbeatUpdate(stream);
+        }
+        return HTTPD_CGI_DONE;
+    }
+
+    if (client != NULL) {
+        // Events are written by cgiSseBroadcast, nothing to do when they have gone out
+        return HTTPD_CGI_MORE;
+    }
+
+    if (connData->requestType != HTTPD_METHOD_GET) {
+        return HTTPD_CGI_NOTFOUND;
+    }
+
+    SseStreamPriv *priv = sseStreamPriv(connData->instance, stream);
+    client = malloc(sizeof(SseClient));
+    if (priv == NULL || client == NULL) {
+        ESP_LOGE(TAG, "Can't allocate mem for event stream client");
+        free(client);
+        httpdStartResponse(connData, 503);
+        httpdEndHeaders(connData);
+        return HTTPD_CGI_DONE;
+    }
+
+    httpdStartResponse(connData, 200);
+    httpdHeader(connData, "Content-Type", "text/event-stream");
+    httpdHeader(connData, "Cache-Control", "no-cache");
+    httpdEndHeaders(connData);
+    if (stream->retryMs > 0) {
+        snprintf(buff, sizeof(buff), "retry: %d\n\n", stream->retryMs);
+        httpdSend(connData, buff, -1);
+    }
+
+    if (priv->historyCount > 0 && httpdGetHeader(connData, "Last-Event-ID", buff, sizeof(buff))) {
+        sseReplay(connData->instance, connData, priv, strtoul(buff, NULL, 10));
+    }
+
+    client->conn = connData;
+    client->next = priv->clients;
+    priv->clients = client;
+    connData->cgiData = client;
+    sseHeartbeatUpdate(stream);
+    return HTTPD_CGI_MORE;
+}
+
+int MEM_ATTR cgiSseBroadcast(HttpdInstance *pInstance, SseStream *stream, const char *event, const char *data) {
+    int ret = 0;
+
+    // a line break would end the event line and let the rest pose as other fields
+    if (event && strpbrk(event, "\r\n")) {
+        ESP_LOGE(TAG, "Event type contains a line break, not sent");
+        return 0;
+    }
+
+    httpdPlatLock(pInstance);
+    SseStreamPriv *priv = sseStreamPriv(pInstance, stream);
+    SseEvent *ev = priv ? sseEventNew(priv->lastId + 1, event, data) : NULL;
+    if (ev == NULL) {
+        ESP_LOGE(TAG, "Can't allocate mem for event");
+        httpdPlatUnlock(pInstance);
+        return 0;
+    }
+    priv->lastId = ev->id;
+
+    for (SseClient *client = priv->clients; client != NULL; client = client->next) {
+        if (client->conn->isConnectionClosed) continue;
+        if (httpdSendDirect(pInstance, client->conn, ev->data, ev->len)) {
+            ret++;
+        } else {
+            // the server task notices the shut down socket and cleans up as usual
+            ESP_LOGW(TAG, "Event %u didn't go out, closing the client", (unsigned)ev->id);
+            httpdPlatAbort(client->conn);
+        }
+    }
+
+    if (stream->historySize > 0) {
+        int slot = (priv->historyHead + priv->historyCount) % stream->historySize;
+        if (priv->historyCount == stream->historySize) {
+            // full, the oldest makes room
+            free(priv->history[priv->historyHead]);
+            priv->historyHead = (priv->historyHead + 1) % stream->historySize;
+        } else {
+            priv->historyCount++;
+        }
+        priv->history[slot] = ev;
+    } else {
+        free(ev);
+    }
+    httpdPlatUnlock(pInstance);
+    return ret;
+}
+
+int MEM_ATTR cgiSseClientCount(SseStream *stream) {
+    int count = 0;
+    SseStreamPriv *priv = stream->priv;
+    if (priv == NULL) return 0;
+    httpdPlatLock(priv->pInstance);
+    for (SseClient *client = priv->clients; client != NULL; client = client->next) count++;
+    httpdPlatUnlock(priv->pInstance);
+    return count;
+}
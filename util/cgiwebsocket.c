@@ -12,8 +12,15 @@ Websocket support for esphttpd. Inspired by https://github.com/dangrie158/ESP-82
 #include "libesphttpd/sha1.h"
 #include "libesphttpd_base64.h"
 #include "libesphttpd/cgiwebsocket.h"
+#include "libesphttpd/kref.h"
+#include "websock_unmask.h"
 
 #include "esp_log.h"
+
+#ifdef CONFIG_ESPHTTPD_WS_DEFLATE
+#include "zlib.h"
+#endif
+
 const static char* TAG = "cgiwebsocket";
 
 #define WS_KEY_IDENTIFIER "Sec-WebSocket-Key: "
@@ -41,6 +48,7 @@ const static char* TAG = "cgiwebsocket";
 */
 
 #define FLAG_FIN (1 << 7)
+#define FLAG_RSV1 (1 << 6) // permessage-deflate: message is compressed
 
 #define OPCODE_CONTINUE 0x0
 #define OPCODE_TEXT 0x1
@@ -73,19 +81,493 @@ struct WebsockFrame {
     uint8_t mask[4];
 };
 
+//Number of hash buckets used to look up the websockets connected to a resource
+#ifndef WEBSOCK_TOPIC_BUCKETS
+#define WEBSOCK_TOPIC_BUCKETS 8
+#endif
+
+//Number of freed message reassembly buffers kept around for reuse
+#ifndef WEBSOCK_MSG_POOL_SIZE
+#define WEBSOCK_MSG_POOL_SIZE 2
+#endif
+
+//Number of freed bridged message buffers kept around for reuse, shared by all websockets
+#ifndef WEBSOCK_RECV_POOL_SIZE
+#define WEBSOCK_RECV_POOL_SIZE 4
+#endif
+
+//Payloads larger than this are written straight from the caller's buffer instead of the send buffer
+#ifndef WEBSOCK_DIRECT_SEND_SIZE
+#define WEBSOCK_DIRECT_SEND_SIZE 1024
+#endif
+
+#define WEBSOCK_FRAME_HEAD_MAX 14
+
+#define WEBSOCK_CLOSE_INVALID_DATA 1007
+#define WEBSOCK_CLOSE_TOO_BIG 1009
+
+#ifdef CONFIG_ESPHTTPD_WS_DEFLATE
+//zlib memLevel of the compressor, it uses (1 << (memLevel+9)) bytes besides the window
+#ifndef WEBSOCK_DEFLATE_MEM_LEVEL
+#define WEBSOCK_DEFLATE_MEM_LEVEL 4
+#endif
+
+//Messages shorter than this are sent uncompressed
+#ifndef WEBSOCK_DEFLATE_MIN_SIZE
+#define WEBSOCK_DEFLATE_MIN_SIZE 64
+#endif
+
+//Size of the chunks inflated messages are passed on in
+#ifndef WEBSOCK_INFLATE_CHUNK
+#define WEBSOCK_INFLATE_CHUNK 512
+#endif
+
+//Per-socket permessage-deflate state
+typedef struct {
+    z_stream inflater;
+    bool compressSends;
+    char out[WEBSOCK_INFLATE_CHUNK];
+} WebsockDeflate;
+#endif
+
+typedef struct WebsockTopic WebsockTopic;
+typedef struct WebsockRegistry WebsockRegistry;
+
+//All websockets connected to the same url
+struct WebsockTopic {
+    uint32_t hash;
+    WebsockTopic *next; // in hash bucket
+    Websock *subscribers;
+    char url[];
+};
+
+//Message being reassembled from its frames
+typedef struct {
+    int size; // capacity of data, not counting the terminating zero
+    int len;
+    char data[];
+} WebsockMsg;
+
+//Encoded frame, header and payload, shared by the queues of all sockets it is sent to
+typedef struct {
+    struct kref ref;
+    int len; // header and payload
+    int dataLen; // bytes in data, only the header when the payload is the caller's
+    const char *payload; // caller's payload of a zero-copy send, NULL when it is in data
+    Websock *ws; // zero-copy send: doneCb is called with these once the frame is released
+    WsSendDoneCb doneCb;
+    void *doneArg;
+    char data[];
+} WebsockFrameBuf;
+
+typedef struct WebsockQueued WebsockQueued;
+struct WebsockQueued {
+    WebsockFrameBuf *frame;
+    WebsockQueued *next;
+};
+
+//Outbound queue of a websocket
+typedef struct {
+    WebsockQueueConfig config;
+    HttpdInstance *pInstance;
+    WebsockQueued *head;
+    WebsockQueued *tail;
+    int headOffset; // bytes of the head frame already written
+    int bytes; // bytes waiting to be written
+    bool aboveHigh; // crossed the high watermark, waiting to get below the low one
+} WebsockQueue;
+
 struct WebsockPriv {
     struct WebsockFrame fr;
     uint8_t maskCtr;
     uint8 frameCont;
     uint8 closedHere;
+    uint8_t msgOpcode; // opcode of the first frame of the current message
+    uint8 receivedSinceTick; // keepalive: heard from the client since the last keepalive tick
+    uint8 awaitingPong;
+    uint32_t pingTick; // keepalive tick the outstanding ping was sent in
+    uint8_t pingLen;
+    char pingData[125]; // payload of the ping being received, echoed in the pong
+    WebsockQueue *queue; // NULL when sends are written out right away
+    QueueHandle_t recvQueue; // complete messages are posted here instead of going to recvCb
     int wsStatus;
-    Websock *next; // in linked list
+    int maxMsgSize; // 0 when not reassembling
+    WebsockMsg *msg;
+#ifdef CONFIG_ESPHTTPD_WS_DEFLATE
+    WebsockDeflate *deflate; // NULL unless permessage-deflate was negotiated
+    bool msgCompressed;
+#endif
+    WebsockRegistry *registry;
+    WebsockTopic *topic;
+    Websock *prev; // in topic subscriber list
+    Websock *next;
 };
 
-static Websock *llStart=NULL;
+//Free bridged message buffers. A queue, so the application tasks can hand buffers back safely.
+//Referenced by the registry and by every message out of the pool.
+struct WebsockRecvPool {
+    struct kref ref;
+    QueueHandle_t free;
+};
 
-static int MEM_ATTR sendFrameHead(Websock *ws, int opcode, int len) {
-    char buf[14];
+//Websocket state of one server instance, guarded by the instance lock
+struct WebsockRegistry {
+    WebsockTopic *topicBuckets[WEBSOCK_TOPIC_BUCKETS];
+    WebsockMsg *msgPool[WEBSOCK_MSG_POOL_SIZE];
+    HttpdInstance *pInstance;
+    HttpdPlatTimerHandle keepaliveTimer;
+    int keepaliveIntervalMs;
+    int keepaliveTimeoutMs;
+    uint32_t keepaliveTick;
+    WebsockRecvPool *recvPool; // created with the first receive queue
+#ifdef CONFIG_ESPHTTPD_WS_DEFLATE
+    // No context takeover was negotiated, so every message starts from a reset compressor
+    // and a message compressed once can go to any number of sockets.
+    z_stream deflater;
+    bool deflaterReady;
+#endif
+};
+
+static void websockRegistryFree(HttpdInstance *pInstance);
+
+//Get the registry of pInstance, creating it on first use. Call with the lock held.
+static WebsockRegistry* MEM_ATTR websockRegistry(HttpdInstance *pInstance) {
+    if (pInstance->websockRegistry == NULL) {
+        WebsockRegistry *registry = malloc(sizeof(WebsockRegistry));
+        if (registry == NULL) return NULL;
+        memset(registry, 0, sizeof(WebsockRegistry));
+        registry->pInstance = pInstance;
+        pInstance->websockRegistry = registry;
+        pInstance->websockRegistryFree = websockRegistryFree;
+    }
+    return pInstance->websockRegistry;
+}
+
+//FNV-1a
+static uint32_t MEM_ATTR topicHash(const char *url) {
+    uint32_t hash = 2166136261u;
+    while (*url) {
+        hash ^= (uint8_t)*url++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static WebsockTopic* MEM_ATTR topicFind(WebsockRegistry *registry, const char *url, uint32_t hash) {
+    WebsockTopic *topic = registry->topicBuckets[hash % WEBSOCK_TOPIC_BUCKETS];
+    while (topic != NULL) {
+        if (topic->hash == hash && strcmp(topic->url, url) == 0) return topic;
+        topic = topic->next;
+    }
+    return NULL;
+}
+
+static bool MEM_ATTR topicSubscribe(Websock *ws) {
+    WebsockRegistry *registry = ws->priv->registry;
+    uint32_t hash = topicHash(ws->conn->url);
+    WebsockTopic *topic = topicFind(registry, ws->conn->url, hash);
+    if (topic == NULL) {
+        topic = malloc(sizeof(WebsockTopic) + strlen(ws->conn->url) + 1);
+        if (topic == NULL) return false;
+        topic->hash = hash;
+        topic->subscribers = NULL;
+        strcpy(topic->url, ws->conn->url);
+        topic->next = registry->topicBuckets[hash % WEBSOCK_TOPIC_BUCKETS];
+        registry->topicBuckets[hash % WEBSOCK_TOPIC_BUCKETS] = topic;
+    }
+    ws->priv->topic = topic;
+    ws->priv->prev = NULL;
+    ws->priv->next = topic->subscribers;
+    if (topic->subscribers) topic->subscribers->priv->prev = ws;
+    topic->subscribers = ws;
+    return true;
+}
+
+static void MEM_ATTR topicUnsubscribe(Websock *ws) {
+    WebsockTopic *topic = ws->priv->topic;
+    if (topic == NULL) return;
+    if (ws->priv->prev) {
+        ws->priv->prev->priv->next = ws->priv->next;
+    } else {
+        topic->subscribers = ws->priv->next;
+    }
+    if (ws->priv->next) ws->priv->next->priv->prev = ws->priv->prev;
+    ws->priv->topic = NULL;
+
+    if (topic->subscribers == NULL) {
+        // last one gone, drop the topic
+        WebsockTopic **pTopic = &ws->priv->registry->topicBuckets[topic->hash % WEBSOCK_TOPIC_BUCKETS];
+        while (*pTopic != topic) pTopic = &(*pTopic)->next;
+        *pTopic = topic->next;
+        free(topic);
+    }
+}
+
+//Make sure the message buffer of ws holds at least 'needed' bytes, taking one from the pool if it has none
+static bool MEM_ATTR websockMsgReserve(Websock *ws, int needed) {
+    WebsockMsg **msgPool = ws->priv->registry->msgPool;
+    if (ws->priv->msg == NULL) {
+        // prefer a pooled buffer that is big enough, else grow whichever one there is
+        int idx, found = -1;
+        for (idx = 0; idx < WEBSOCK_MSG_POOL_SIZE; idx++) {
+            if (msgPool[idx] == NULL) continue;
+            found = idx;
+            if (msgPool[idx]->size >= needed) break;
+        }
+        if (found >= 0) {
+            ws->priv->msg = msgPool[found];
+            msgPool[found] = NULL;
+            ws->priv->msg->len = 0;
+        }
+    }
+
+    WebsockMsg *msg = ws->priv->msg;
+    if (msg == NULL || msg->size < needed) {
+        // grow in steps when the data trickles in, inflated messages don't announce their size
+        if (msg != NULL && needed < msg->size * 2) {
+            needed = (msg->size * 2 < ws->priv->maxMsgSize) ? msg->size * 2 : ws->priv->maxMsgSize;
+        }
+        WebsockMsg *grown = realloc(msg, sizeof(WebsockMsg) + needed + 1);
+        if (grown == NULL) return false;
+        if (msg == NULL) grown->len = 0;
+        grown->size = needed;
+        ws->priv->msg = grown;
+    }
+    return true;
+}
+
+//Hand the message buffer of ws back to the pool
+static void MEM_ATTR websockMsgRelease(Websock *ws) {
+    WebsockMsg **msgPool = ws->priv->registry->msgPool;
+    if (ws->priv->msg == NULL) return;
+    for (int idx = 0; idx < WEBSOCK_MSG_POOL_SIZE; idx++) {
+        if (msgPool[idx] == NULL) {
+            msgPool[idx] = ws->priv->msg;
+            ws->priv->msg = NULL;
+            return;
+        }
+    }
+    free(ws->priv->msg);
+    ws->priv->msg = NULL;
+}
+
+static void MEM_ATTR websockRecvPoolRelease(struct kref *ref) {
+    WebsockRecvPool *pool = kcontainer_of(ref, WebsockRecvPool, ref);
+    WebsockRecvMsg *msg;
+    while (xQueueReceive(pool->free, &msg, 0) == pdTRUE) free(msg);
+    vQueueDelete(pool->free);
+    free(pool);
+}
+
+//Copy a complete message into a pooled buffer and post it to the receive queue of ws
+static void MEM_ATTR websockPostMsg(Websock *ws, const char *data, int len, int flags) {
+    WebsockRecvPool *pool = ws->priv->registry->recvPool;
+    WebsockRecvMsg *msg = NULL;
+    if (xQueueReceive(pool->free, &msg, 0) != pdTRUE) msg = NULL;
+    if (msg == NULL || msg->size < len) {
+        WebsockRecvMsg *grown = realloc(msg, sizeof(WebsockRecvMsg) + len + 1);
+        if (grown == NULL) {
+            ESP_LOGE(TAG, "Can't allocate %d bytes for message, dropped", len);
+            free(msg);
+            return;
+        }
+        msg = grown;
+        msg->size = len;
+    }
+    // every message out of the pool keeps it alive, the registry may be gone before it comes back
+    msg->pool = pool;
+    kref_get(&pool->ref);
+    msg->ws = ws;
+    msg->flags = flags;
+    msg->len = len;
+    memcpy(msg->data, data, len);
+    msg->data[len] = 0;
+    if (xQueueSend(ws->priv->recvQueue, &msg, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Receive queue full, message of %d bytes dropped", len);
+        cgiWebsocketMsgFree(msg);
+    }
+}
+
+void MEM_ATTR cgiWebsocketMsgFree(WebsockRecvMsg *msg) {
+    if (msg == NULL) return;
+    WebsockRecvPool *pool = msg->pool;
+    if (xQueueSend(pool->free, &msg, 0) != pdTRUE) free(msg);
+    kref_put(&pool->ref, websockRecvPoolRelease);
+}
+
+//Pass message data on to recvCb, or collect it first when reassembling. 'expected' is the amount of data
+//still to come in the current frame, used to size the reassembly buffer up front.
+//Returns 0, or the close code to fail the websocket with.
+static int MEM_ATTR websockDeliver(Websock *ws, char *data, int len, int flags, bool last, uint64_t expected) {
+    if (!ws->priv->maxMsgSize) {
+        if (!last) flags|=WEBSOCK_FLAG_MORE;
+        if (ws->recvCb) ws->recvCb(ws, data, len, flags);
+        return 0;
+    }
+
+    uint64_t needed = (ws->priv->msg ? ws->priv->msg->len : 0) + ((expected > len) ? expected : len);
+    if (needed > ws->priv->maxMsgSize || !websockMsgReserve(ws, (int)needed)) {
+        ESP_LOGE(TAG, "Message of %d+ bytes too big", (int)needed);
+        return WEBSOCK_CLOSE_TOO_BIG;
+    }
+    WebsockMsg *msg = ws->priv->msg;
+    memcpy(&msg->data[msg->len], data, len);
+    msg->len += len;
+    if (last) {
+        msg->data[msg->len] = 0;
+        if (ws->priv->recvQueue) {
+            websockPostMsg(ws, msg->data, msg->len, flags);
+        } else if (ws->recvCb) {
+            ws->recvCb(ws, msg->data, msg->len, flags);
+        }
+        websockMsgRelease(ws);
+    }
+    return 0;
+}
+
+#ifdef CONFIG_ESPHTTPD_WS_DEFLATE
+//Inflate a piece of a compressed message and deliver the output. Returns 0 or a close code.
+static int MEM_ATTR websockInflate(Websock *ws, char *data, int len, int flags, bool last) {
+    // RFC 7692 7.2.2: the sender strips the end of the final sync flush, put it back
+    static const uint8_t flushTail[4] = { 0x00, 0x00, 0xff, 0xff };
+    WebsockDeflate *d = ws->priv->deflate;
+    int ret;
+
+    d->inflater.next_in = (Bytef *)data;
+    d->inflater.avail_in = len;
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            if (!last) break;
+            d->inflater.next_in = (Bytef *)flushTail;
+            d->inflater.avail_in = sizeof(flushTail);
+        }
+        do {
+            d->inflater.next_out = (Bytef *)d->out;
+            d->inflater.avail_out = sizeof(d->out);
+            int zr = inflate(&d->inflater, Z_SYNC_FLUSH);
+            if (zr != Z_OK && zr != Z_BUF_ERROR && zr != Z_STREAM_END) {
+                ESP_LOGE(TAG, "inflate failed %d", zr);
+                return WEBSOCK_CLOSE_INVALID_DATA;
+            }
+            int outLen = sizeof(d->out) - d->inflater.avail_out;
+            if (outLen && (ret = websockDeliver(ws, d->out, outLen, flags, false, 0)) != 0) return ret;
+        } while (d->inflater.avail_out == 0);
+    }
+
+    if (last) {
+        // client_no_context_takeover: the next message starts with an empty window
+        inflateReset(&d->inflater);
+        return websockDeliver(ws, d->out, 0, flags, true, 0);
+    }
+    return 0;
+}
+
+//Compress a complete message for sending. Returns a malloc()ed payload to send with RSV1 set,
+//or NULL to send the message uncompressed.
+static char* MEM_ATTR websockDeflate(WebsockRegistry *registry, const char *data, int len, int *deflatedLen) {
+    z_stream *deflater = &registry->deflater;
+    if (len < WEBSOCK_DEFLATE_MIN_SIZE) return NULL;
+
+    if (!registry->deflaterReady) {
+        memset(deflater, 0, sizeof(z_stream));
+        if (deflateInit2(deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                -CONFIG_ESPHTTPD_WS_DEFLATE_WINDOW_BITS, WEBSOCK_DEFLATE_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+            ESP_LOGE(TAG, "deflateInit2 failed");
+            return NULL;
+        }
+        registry->deflaterReady = true;
+    }
+
+    // room for the sync flush marker on top of the worst case
+    int outSize = deflateBound(deflater, len) + 6;
+    char *out = malloc(outSize);
+    if (out == NULL) return NULL;
+
+    deflateReset(deflater);
+    deflater->next_in = (Bytef *)data;
+    deflater->avail_in = len;
+    deflater->next_out = (Bytef *)out;
+    deflater->avail_out = outSize;
+    int zr = deflate(deflater, Z_SYNC_FLUSH);
+    int outLen = outSize - deflater->avail_out;
+    if (zr != Z_OK || deflater->avail_in != 0 || outLen < 4 || outLen - 4 >= len) {
+        // failed or didn't pay off
+        free(out);
+        return NULL;
+    }
+
+    *deflatedLen = outLen - 4; // strip the 00 00 ff ff of the sync flush
+    return out;
+}
+
+static int MEM_ATTR parseWindowBits(const char *value, int *bits) {
+    if (*value == '"') value++;
+    int v = atoi(value);
+    // zlib can't do raw deflate with a 256 byte window
+    if (v < 9 || v > 15) return 0;
+    *bits = v;
+    return 1;
+}
+
+//Pick the first permessage-deflate offer in a Sec-WebSocket-Extensions header we can accept.
+//Fills in the response (which may share the buffer of offers) and the window size the client will
+//compress with. Returns false to decline.
+static bool MEM_ATTR websockNegotiateDeflate(char *offers, char *response, int responseLen, int *clientBits) {
+    char *offerSave, *paramSave;
+    for (char *offer = strtok_r(offers, ",", &offerSave); offer; offer = strtok_r(NULL, ",", &offerSave)) {
+        int clientLimit = 15;
+        bool clientBitsOffered = false;
+        bool acceptable = true;
+
+        char *param = strtok_r(offer, ";", &paramSave);
+        while (param && *param == ' ') param++;
+        if (!param || strncmp(param, "permessage-deflate", 18) != 0 || (param[18] != '\0' && param[18] != ' ')) continue;
+
+        while (acceptable && (param = strtok_r(NULL, ";", &paramSave)) != NULL) {
+            while (*param == ' ') param++;
+            char *value = strchr(param, '=');
+            if (value) *value++ = '\0';
+            char *end = param + strlen(param);
+            while (end > param && end[-1] == ' ') *--end = '\0';
+
+            if (strcmp(param, "server_no_context_takeover") == 0 ||
+                strcmp(param, "client_no_context_takeover") == 0) {
+                // we use no context takeover both ways anyway
+            } else if (strcmp(param, "server_max_window_bits") == 0) {
+                // the shared compressor has one window size, decline clients that want less
+                int requested;
+                if (!value || !parseWindowBits(value, &requested) || requested < CONFIG_ESPHTTPD_WS_DEFLATE_WINDOW_BITS) {
+                    acceptable = false;
+                }
+            } else if (strcmp(param, "client_max_window_bits") == 0) {
+                clientBitsOffered = true;
+                if (value && !parseWindowBits(value, &clientLimit)) acceptable = false;
+            } else {
+                acceptable = false;
+            }
+        }
+        // a client that can't be limited compresses with a 32k window, which the inflater would have to hold
+        if (!acceptable || (!clientBitsOffered && CONFIG_ESPHTTPD_WS_DEFLATE_WINDOW_BITS < 15)) continue;
+
+        *clientBits = 15;
+        if (clientBitsOffered) {
+            *clientBits = (CONFIG_ESPHTTPD_WS_DEFLATE_WINDOW_BITS < clientLimit) ? CONFIG_ESPHTTPD_WS_DEFLATE_WINDOW_BITS : clientLimit;
+        }
+        snprintf(response, responseLen,
+                "permessage-deflate; server_no_context_takeover; client_no_context_takeover; server_max_window_bits=%d",
+                CONFIG_ESPHTTPD_WS_DEFLATE_WINDOW_BITS);
+        if (clientBitsOffered) {
+            int used = strlen(response);
+            snprintf(response + used, responseLen - used, "; client_max_window_bits=%d", *clientBits);
+        }
+        return true;
+    }
+    return false;
+}
+#endif
+
+//Encode a frame header into buf, which must hold WEBSOCK_FRAME_HEAD_MAX bytes. Returns the header length.
+static int MEM_ATTR encodeFrameHead(char *buf, int opcode, int len) {
     int i = 0;
     buf[i++] = opcode;
     if (len>65535) {
@@ -102,12 +584,160 @@ static int MEM_ATTR sendFrameHead(Websock *ws, int opcode, int len) {
     } else {
         buf[i++] = len;
     }
+    return i;
+}
+
+static WebsockFrameBuf* MEM_ATTR websockFrameNew(int opcode, const char *data, int len) {
+    WebsockFrameBuf *frame = malloc(sizeof(WebsockFrameBuf) + WEBSOCK_FRAME_HEAD_MAX + len);
+    if (frame == NULL) return NULL;
+    kref_init(&frame->ref);
+    frame->len = encodeFrameHead(frame->data, opcode, len);
+    if (len) memcpy(&frame->data[frame->len], data, len);
+    frame->len += len;
+    frame->dataLen = frame->len;
+    frame->payload = NULL;
+    frame->doneCb = NULL;
+    return frame;
+}
+
+//Frame that only holds the header and points at the caller's payload
+static WebsockFrameBuf* MEM_ATTR websockFrameNewZeroCopy(Websock *ws, int opcode, const char *data, int len, WsSendDoneCb doneCb, void *arg) {
+    WebsockFrameBuf *frame = malloc(sizeof(WebsockFrameBuf) + WEBSOCK_FRAME_HEAD_MAX);
+    if (frame == NULL) return NULL;
+    kref_init(&frame->ref);
+    frame->dataLen = encodeFrameHead(frame->data, opcode, len);
+    frame->len = frame->dataLen + len;
+    frame->payload = data;
+    frame->ws = ws;
+    frame->doneCb = doneCb;
+    frame->doneArg = arg;
+    return frame;
+}
+
+static void MEM_ATTR websockFrameRelease(struct kref *ref) {
+    WebsockFrameBuf *frame = kcontainer_of(ref, WebsockFrameBuf, ref);
+    if (frame->doneCb) frame->doneCb(frame->ws, frame->payload, frame->doneArg);
+    free(frame);
+}
+
+//Bytes of frame that are contiguous in memory from offset on
+static int MEM_ATTR websockFramePiece(WebsockFrameBuf *frame, int offset, const char **piece) {
+    if (offset < frame->dataLen) {
+        *piece = &frame->data[offset];
+        return frame->dataLen - offset;
+    }
+    *piece = &frame->payload[offset - frame->dataLen];
+    return frame->len - offset;
+}
+
+//Remove the queue entry following prev (the head when prev is NULL)
+static void MEM_ATTR websockQueueRemove(WebsockQueue *q, WebsockQueued *prev) {
+    WebsockQueued *entry = prev ? prev->next : q->head;
+    if (prev) {
+        prev->next = entry->next;
+    } else {
+        q->head = entry->next;
+        q->bytes += q->headOffset;
+        q->headOffset = 0;
+    }
+    if (q->tail == entry) q->tail = prev;
+    q->bytes -= entry->frame->len;
+    kref_put(&entry->frame->ref, websockFrameRelease);
+    free(entry);
+}
+
+//Check the watermarks after the queue grew or shrunk
+static void MEM_ATTR websockQueueWatermarks(Websock *ws) {
+    WebsockQueue *q = ws->priv->queue;
+    if (!q->aboveHigh && q->bytes >= q->config.highWatermark) {
+        q->aboveHigh = true;
+        if (q->config.highCb) q->config.highCb(ws);
+    } else if (q->aboveHigh && q->bytes <= q->config.lowWatermark) {
+        q->aboveHigh = false;
+        if (q->config.lowCb) q->config.lowCb(ws);
+    }
+}
+
+//Queue a frame on ws, making room according to the queue policy. Returns 1 when queued.
+static int MEM_ATTR websockEnqueue(Websock *ws, WebsockFrameBuf *frame) {
+    WebsockQueue *q = ws->priv->queue;
+
+    if (q->bytes + frame->len > q->config.maxBytes) {
+        if (q->config.policy == WEBSOCK_QUEUE_DISCONNECT) {
+            ESP_LOGW(TAG, "Outbound queue full, disconnecting slow websocket");
+            httpdPlatAbort(ws->conn);
+            return 0;
+        }
+        // a frame that is partly written has to be finished, everything behind it can go
+        WebsockQueued *keep = (q->headOffset > 0) ? q->head : NULL;
+        while ((keep ? keep->next : q->head) != NULL &&
+               (q->config.policy == WEBSOCK_QUEUE_COALESCE_LATEST || q->bytes + frame->len > q->config.maxBytes)) {
+            websockQueueRemove(q, keep);
+        }
+        if (q->bytes + frame->len > q->config.maxBytes) {
+            ESP_LOGW(TAG, "Frame of %d bytes doesn't fit in the outbound queue, dropped", frame->len);
+            return 0;
+        }
+    }
+
+    WebsockQueued *entry = malloc(sizeof(WebsockQueued));
+    if (entry == NULL) return 0;
+    kref_get(&frame->ref);
+    entry->frame = frame;
+    entry->next = NULL;
+    if (q->tail) {
+        q->tail->next = entry;
+    } else {
+        q->head = entry;
+    }
+    q->tail = entry;
+    q->bytes += frame->len;
+    websockQueueWatermarks(ws);
+    return 1;
+}
+
+//Write out as much of the queue as the socket takes without blocking. What is left goes out
+//from the sent callback once the socket is writable again.
+static void MEM_ATTR websockDrain(Websock *ws) {
+    WebsockQueue *q = ws->priv->queue;
+    if (q->head == NULL) return;
+
+    // anything in the send buffer goes first, the upgrade response for example
+    httpdFlushSendBuffer(q->pInstance, ws->conn);
+    while (q->head != NULL) {
+        WebsockFrameBuf *frame = q->head->frame;
+        const char *piece;
+        int pieceLen = websockFramePiece(frame, q->headOffset, &piece);
+        int r = httpdPlatSendNonblock(q->pInstance, ws->conn, piece, pieceLen);
+        if (r < 0) {
+            // the server task closes the connection
+            ESP_LOGE(TAG, "Outbound queue write failed");
+            break;
+        }
+        q->headOffset += r;
+        q->bytes -= r;
+        if (r < pieceLen) break;
+        if (q->headOffset == frame->len) websockQueueRemove(q, NULL);
+    }
+    websockQueueWatermarks(ws);
+}
+
+static void MEM_ATTR websockQueueFree(Websock *ws) {
+    WebsockQueue *q = ws->priv->queue;
+    if (q == NULL) return;
+    while (q->head) websockQueueRemove(q, NULL);
+    free(q);
+    ws->priv->queue = NULL;
+}
+
+static int MEM_ATTR sendFrameHead(Websock *ws, int opcode, int len) {
+    char buf[WEBSOCK_FRAME_HEAD_MAX];
+    int i = encodeFrameHead(buf, opcode, len);
     ESP_LOGD(TAG, "Sent frame head for payload of %d bytes", len);
     return httpdSend(ws->conn, buf, i);
 }
 
-int MEM_ATTR cgiWebsocketSend(HttpdInstance *pInstance, Websock *ws, const char *data, int len, int flags) {
-    int r = 0;
+static int MEM_ATTR frameOpcode(int flags) {
     int fl = 0;
 
     // Continuation frame has opcode 0
@@ -119,6 +749,77 @@ int MEM_ATTR cgiWebsocketSend(HttpdInstance *pInstance, Websock *ws, const char
     }
     // add FIN to last frame
     if (!(flags&WEBSOCK_FLAG_MORE)) fl|=FLAG_FIN;
+    return fl;
+}
+
+//Write header and payload out directly as one frame, the header from the stack and the payload from
+//where it is. Blocks until written. Returns 1 on success.
+static int MEM_ATTR websockWriteFrame(HttpdInstance *pInstance, Websock *ws, int opcode, const char *data, int len) {
+    char head[WEBSOCK_FRAME_HEAD_MAX];
+    struct iovec iov[2];
+    iov[0].iov_base = head;
+    iov[0].iov_len = encodeFrameHead(head, opcode, len);
+    iov[1].iov_base = (char *)data;
+    iov[1].iov_len = len;
+
+    // anything already in the send buffer goes first
+    httpdFlushSendBuffer(pInstance, ws->conn);
+    int r = (httpdPlatSendIov(pInstance, ws->conn, iov, (len != 0) ? 2 : 1) == iov[0].iov_len + len);
+    if (!r) ESP_LOGE(TAG, "Failed to send %d byte frame", len);
+    return r;
+}
+
+//Write a complete frame to a socket without an outbound queue, without blocking. Returns 1 when
+//written, 0 when the socket had no room and nothing was written, -1 when only part of the frame
+//went out or the write failed. Half a frame leaves nothing to resume from, the connection is
+//closed then. Call with the lock held.
+static int MEM_ATTR websockWriteFrameNonblock(HttpdInstance *pInstance, Websock *ws, const struct iovec *iov, int iovcnt) {
+    int frameLen = 0;
+    for (int i = 0; i < iovcnt; i++) frameLen += iov[i].iov_len;
+
+    // anything already in the send buffer goes first
+    httpdFlushSendBuffer(pInstance, ws->conn);
+    int r = httpdPlatSendIovNonblock(pInstance, ws->conn, iov, iovcnt);
+    if (r == frameLen) return 1;
+    if (r == 0) return 0;
+    // the server task notices the shut down socket and cleans up as usual
+    ESP_LOGW(TAG, "Wrote %d of %d frame bytes to a websocket that can't keep up, closing it", r, frameLen);
+    httpdPlatAbort(ws->conn);
+    return -1;
+}
+
+//Send one complete frame. It is queued on sockets with an outbound queue and written out right away
+//on the others. Call with the lock held. Returns 1 when sent or queued.
+static int MEM_ATTR websockSendFrame(HttpdInstance *pInstance, Websock *ws, int opcode, const char *data, int len, int flags) {
+    int r = 0;
+
+    if (ws->priv->queue) {
+        WebsockFrameBuf *frame = websockFrameNew(opcode, data, len);
+        if (frame == NULL) {
+            ESP_LOGE(TAG, "Can't allocate %d byte frame", len);
+            return 0;
+        }
+        r = websockEnqueue(ws, frame);
+        kref_put(&frame->ref, websockFrameRelease);
+        websockDrain(ws);
+    } else if (len > WEBSOCK_DIRECT_SEND_SIZE) {
+        // too big for the send buffer
+        r = websockWriteFrame(pInstance, ws, opcode, data, len);
+    } else {
+        sendFrameHead(ws, opcode, len);
+        r = (len != 0) ? httpdSend(ws->conn, data, len) : 1;
+        httpdFlushSendBuffer(pInstance, ws->conn);
+    }
+
+    if (flags & WEBSOCK_FLAG_FLUSH) {
+        httpdFlushSendBufferNow(pInstance, ws->conn);
+    }
+    return r;
+}
+
+int MEM_ATTR cgiWebsocketSend(HttpdInstance *pInstance, Websock *ws, const char *data, int len, int flags) {
+    int r = 0;
+    int fl = frameOpcode(flags);
 
     if (ws->conn->isConnectionClosed) {
         ESP_LOGE(TAG, "Websocket closed, cannot send");
@@ -126,26 +827,347 @@ int MEM_ATTR cgiWebsocketSend(HttpdInstance *pInstance, Websock *ws, const char
     }
 
     httpdPlatLock(pInstance);
-    sendFrameHead(ws, fl, len);
-    if (len != 0) r = httpdSend(ws->conn, data, len);
-    httpdFlushSendBuffer(pInstance, ws->conn);
+#ifdef CONFIG_ESPHTTPD_WS_DEFLATE
+    // only whole messages are compressed, fragmented ones go out as they are
+    char *deflated = NULL;
+    if (ws->priv->deflate && ws->priv->deflate->compressSends && !(flags & (WEBSOCK_FLAG_MORE|WEBSOCK_FLAG_CONT))) {
+        int deflatedLen;
+        deflated = websockDeflate(ws->priv->registry, data, len, &deflatedLen);
+        if (deflated) {
+            fl |= FLAG_RSV1;
+            data = deflated;
+            len = deflatedLen;
+        }
+    }
+#endif
+    r = websockSendFrame(pInstance, ws, fl, data, len, flags);
+    httpdPlatUnlock(pInstance);
+#ifdef CONFIG_ESPHTTPD_WS_DEFLATE
+    free(deflated);
+#endif
+    return r;
+}
+
+int MEM_ATTR cgiWebsocketSendZeroCopy(HttpdInstance *pInstance, Websock *ws, const char *data, int len, int flags,
+                                      WsSendDoneCb doneCb, void *arg) {
+    int r = 0;
+    int fl = frameOpcode(flags);
+
+    if (ws->conn->isConnectionClosed) {
+        ESP_LOGE(TAG, "Websocket closed, cannot send");
+        if (doneCb) doneCb(ws, data, arg);
+        return WEBSOCK_CLOSED;
+    }
+
+    httpdPlatLock(pInstance);
+    if (ws->priv->queue) {
+        // the queue entry points at the caller's buffer, doneCb runs when the entry is released
+        WebsockFrameBuf *frame = websockFrameNewZeroCopy(ws, fl, data, len, doneCb, arg);
+        if (frame == NULL) {
+            ESP_LOGE(TAG, "Can't allocate frame head");
+            if (doneCb) doneCb(ws, data, arg);
+        } else {
+            r = websockEnqueue(ws, frame);
+            kref_put(&frame->ref, websockFrameRelease);
+            websockDrain(ws);
+        }
+    } else {
+        r = websockWriteFrame(pInstance, ws, fl, data, len);
+        if (doneCb) doneCb(ws, data, arg);
+    }
+    if (flags & WEBSOCK_FLAG_FLUSH) {
+        httpdFlushSendBufferNow(pInstance, ws->conn);
+    }
     httpdPlatUnlock(pInstance);
     return r;
 }
 
+bool MEM_ATTR cgiWebsocketSetQueue(HttpdInstance *pInstance, Websock *ws, const WebsockQueueConfig *config) {
+    bool ret = true;
+    httpdPlatLock(pInstance);
+    if (config == NULL) {
+        // write out what is still queued, blocking, before sends bypass the queue again
+        WebsockQueue *q = ws->priv->queue;
+        bool failed = false;
+        if (q && q->head) httpdFlushSendBuffer(pInstance, ws->conn);
+        while (q && q->head && !failed) {
+            WebsockFrameBuf *frame = q->head->frame;
+            const char *piece;
+            while (q->headOffset < frame->len) {
+                int pieceLen = websockFramePiece(frame, q->headOffset, &piece);
+                if (httpdPlatSendData(pInstance, ws->conn, (char *)piece, pieceLen) != pieceLen) {
+                    // the server task closes the connection, the rest of the queue is dropped
+                    ESP_LOGE(TAG, "Outbound queue write failed");
+                    httpdPlatAbort(ws->conn);
+                    failed = true;
+                    break;
+                }
+                q->headOffset += pieceLen;
+                q->bytes -= pieceLen;
+            }
+            if (!failed) websockQueueRemove(q, NULL);
+        }
+        websockQueueFree(ws);
+    } else {
+        if (ws->priv->queue == NULL) {
+            ws->priv->queue = malloc(sizeof(WebsockQueue));
+            if (ws->priv->queue) memset(ws->priv->queue, 0, sizeof(WebsockQueue));
+        }
+        if (ws->priv->queue) {
+            ws->priv->queue->config = *config;
+            ws->priv->queue->pInstance = pInstance;
+        } else {
+            ESP_LOGE(TAG, "Can't allocate mem for websocket queue");
+            ret = false;
+        }
+    }
+    httpdPlatUnlock(pInstance);
+    return ret;
+}
+
+int MEM_ATTR cgiWebsocketQueuedBytes(Websock *ws) {
+    return ws->priv->queue ? ws->priv->queue->bytes : 0;
+}
+
+void MEM_ATTR cgiWebsocketSetCompression(Websock *ws, bool enable) {
+#ifdef CONFIG_ESPHTTPD_WS_DEFLATE
+    if (ws->priv->deflate) ws->priv->deflate->compressSends = enable;
+#endif
+}
+
+//Ping websockets that were quiet for an interval, drop the ones that didn't answer the last ping in time.
+//Runs on the server task, posted by keepaliveTimerCb.
+static void MEM_ATTR websockKeepaliveTick(HttpdInstance *pInstance, void *arg) {
+    WebsockRegistry *registry = pInstance->websockRegistry;
+    int reaped = 0;
+
+    // keepalive may have been stopped since the tick was posted
+    if (registry == NULL || registry->keepaliveTimer == NULL) return;
+
+    registry->keepaliveTick++;
+    for (int bucket = 0; bucket < WEBSOCK_TOPIC_BUCKETS; bucket++) {
+        for (WebsockTopic *topic = registry->topicBuckets[bucket]; topic != NULL; topic = topic->next) {
+            for (Websock *ws = topic->subscribers; ws != NULL; ws = ws->priv->next) {
+                if (ws->conn->isConnectionClosed) continue;
+                if (ws->priv->awaitingPong) {
+                    if ((registry->keepaliveTick - ws->priv->pingTick) * registry->keepaliveIntervalMs >= registry->keepaliveTimeoutMs) {
+                        // the server task notices the shut down socket and cleans up as usual
+                        ESP_LOGW(TAG, "No pong from websocket on %s, closing it", topic->url);
+                        httpdPlatAbort(ws->conn);
+                        ws->priv->awaitingPong = 0;
+                        reaped++;
+                    }
+                } else if (!ws->priv->receivedSinceTick) {
+                    if (ws->priv->queue) {
+                        websockSendFrame(pInstance, ws, OPCODE_PING|FLAG_FIN, NULL, 0, WEBSOCK_FLAG_FLUSH);
+                    } else {
+                        // a peer that has stopped taking data would block a normal write for the
+                        // whole send timeout; a ping that doesn't fit at once marks it dead
+                        char head[WEBSOCK_FRAME_HEAD_MAX];
+                        struct iovec iov = { .iov_base = head, .iov_len = encodeFrameHead(head, OPCODE_PING|FLAG_FIN, 0) };
+                        int r = websockWriteFrameNonblock(pInstance, ws, &iov, 1);
+                        if (r <= 0) {
+                            if (r == 0) {
+                                ESP_LOGW(TAG, "Websocket on %s takes no data, closing it", topic->url);
+                                httpdPlatAbort(ws->conn);
+                            }
+                            reaped++;
+                            ws->priv->receivedSinceTick = 0;
+                            continue;
+                        }
+                        httpdPlatFlushData(pInstance, ws->conn);
+                    }
+                    ws->priv->awaitingPong = 1;
+                    ws->priv->pingTick = registry->keepaliveTick;
+                }
+                ws->priv->receivedSinceTick = 0;
+            }
+        }
+    }
+    if (reaped) ESP_LOGI(TAG, "Keepalive closed %d websockets", reaped);
+}
+
+//Runs on the timer task, which must not block on the lock or on sockets; hand the work to the server task.
+//A tick that can't be posted is skipped, the next one catches up.
+static void MEM_ATTR keepaliveTimerCb(void *arg) {
+    HttpdInstance *pInstance = httpdPlatTimerGetContext((HttpdPlatTimerHandle)arg);
+    if (!httpdPlatPost(pInstance, websockKeepaliveTick, NULL)) {
+        ESP_LOGW(TAG, "Can't post keepalive tick");
+    }
+}
+
+//Call with the lock held
+static void MEM_ATTR websockKeepaliveStop(WebsockRegistry *registry) {
+    if (registry->keepaliveTimer == NULL) return;
+    httpdPlatTimerStop(registry->keepaliveTimer);
+    httpdPlatTimerDelete(registry->keepaliveTimer);
+    registry->keepaliveTimer = NULL;
+}
+
+//Called by the platform code when the server task of pInstance exits. Its connections are closed
+//by then, which leaves the pooled buffers, the compressor and the keepalive timer.
+static void websockRegistryFree(HttpdInstance *pInstance) {
+    httpdPlatLock(pInstance);
+    WebsockRegistry *registry = pInstance->websockRegistry;
+    if (registry != NULL) {
+        websockKeepaliveStop(registry);
+        for (int bucket = 0; bucket < WEBSOCK_TOPIC_BUCKETS; bucket++) {
+            while (registry->topicBuckets[bucket] != NULL) {
+                WebsockTopic *topic = registry->topicBuckets[bucket];
+                registry->topicBuckets[bucket] = topic->next;
+                for (Websock *ws = topic->subscribers; ws != NULL; ws = ws->priv->next) ws->priv->topic = NULL;
+                free(topic);
+            }
+        }
+        for (int idx = 0; idx < WEBSOCK_MSG_POOL_SIZE; idx++) free(registry->msgPool[idx]);
+        // messages still held by the application free the pool when they come back
+        if (registry->recvPool) kref_put(&registry->recvPool->ref, websockRecvPoolRelease);
+#ifdef CONFIG_ESPHTTPD_WS_DEFLATE
+        if (registry->deflaterReady) deflateEnd(&registry->deflater);
+#endif
+        free(registry);
+        pInstance->websockRegistry = NULL;
+    }
+    pInstance->websockRegistryFree = NULL;
+    httpdPlatUnlock(pInstance);
+}
+
+void MEM_ATTR cgiWebsockKeepaliveStart(HttpdInstance *pInstance, int intervalMs, int timeoutMs) {
+    httpdPlatLock(pInstance);
+    WebsockRegistry *registry = websockRegistry(pInstance);
+    if (registry == NULL) {
+        ESP_LOGE(TAG, "Can't allocate mem for websocket registry");
+    } else {
+        websockKeepaliveStop(registry);
+        registry->keepaliveIntervalMs = intervalMs;
+        registry->keepaliveTimeoutMs = timeoutMs;
+        registry->keepaliveTimer = httpdPlatTimerCreate("wskeepalive", intervalMs, 1, keepaliveTimerCb, pInstance);
+        if (registry->keepaliveTimer == NULL) {
+            ESP_LOGE(TAG, "Can't create keepalive timer");
+        } else {
+            httpdPlatTimerStart(registry->keepaliveTimer);
+        }
+    }
+    httpdPlatUnlock(pInstance);
+}
+
+void MEM_ATTR cgiWebsockKeepaliveStop(HttpdInstance *pInstance) {
+    httpdPlatLock(pInstance);
+    if (pInstance->websockRegistry != NULL) websockKeepaliveStop(pInstance->websockRegistry);
+    httpdPlatUnlock(pInstance);
+}
+
+void MEM_ATTR cgiWebsocketReassemble(Websock *ws, int maxMsgSize) {
+    ws->priv->maxMsgSize = maxMsgSize;
+    if (maxMsgSize == 0) websockMsgRelease(ws);
+}
+
+bool MEM_ATTR cgiWebsocketSetRecvQueue(Websock *ws, QueueHandle_t queue, int maxMsgSize) {
+    HttpdInstance *pInstance = ws->conn->instance;
+    WebsockRegistry *registry = ws->priv->registry;
+
+    httpdPlatLock(pInstance);
+    if (queue != NULL && registry->recvPool == NULL) {
+        WebsockRecvPool *pool = malloc(sizeof(WebsockRecvPool));
+        if (pool != NULL) {
+            pool->free = xQueueCreate(WEBSOCK_RECV_POOL_SIZE, sizeof(WebsockRecvMsg *));
+            if (pool->free == NULL) {
+                free(pool);
+                pool = NULL;
+            }
+        }
+        if (pool == NULL) {
+            ESP_LOGE(TAG, "Can't create message pool");
+            httpdPlatUnlock(pInstance);
+            return false;
+        }
+        kref_init(&pool->ref);
+        registry->recvPool = pool;
+    }
+    ws->priv->recvQueue = queue;
+    cgiWebsocketReassemble(ws, queue ? maxMsgSize : 0);
+    httpdPlatUnlock(pInstance);
+    return true;
+}
+
 // Broadcast data to all websockets at a specific url. Returns the amount of connections sent to.
+// The frame header is encoded once and header and payload are written straight from here to every
+// socket, without going through the send buffers. Sockets with an outbound queue all share one
+// encoded copy of the frame and never hold up the broadcast.
 int MEM_ATTR cgiWebsockBroadcast(HttpdInstance *pInstance, const char *resource, char *data, int len, int flags) {
-    Websock *lw = llStart;
+    char head[WEBSOCK_FRAME_HEAD_MAX];
+    struct iovec iov[2];
+    WebsockFrameBuf *queuedFrame[2] = { NULL, NULL }; // plain and compressed, built when first needed
     int ret = 0;
+
+    iov[0].iov_base = head;
+    iov[0].iov_len = encodeFrameHead(head, frameOpcode(flags), len);
+    iov[1].iov_base = data;
+    iov[1].iov_len = len;
+
+#ifdef CONFIG_ESPHTTPD_WS_DEFLATE
+    // compressed on the first subscriber that wants it, then reused for the others
+    char deflatedHead[WEBSOCK_FRAME_HEAD_MAX];
+    struct iovec deflatedIov[2];
+    char *deflated = NULL;
+    bool deflateTried = (flags & (WEBSOCK_FLAG_MORE|WEBSOCK_FLAG_CONT)) != 0;
+#endif
+
+    httpdPlatLock(pInstance);
+    WebsockRegistry *registry = pInstance->websockRegistry;
+    WebsockTopic *topic = registry ? topicFind(registry, resource, topicHash(resource)) : NULL;
+    Websock *lw = topic ? topic->subscribers : NULL;
     while (lw != NULL) {
-        if (strcmp(lw->conn->url, resource) == 0) {
-            httpdConnSendStart(pInstance, lw->conn);
-            cgiWebsocketSend(pInstance, lw, data, len, flags);
-            httpdConnSendFinish(pInstance, lw->conn);
-            ret++;
+        if (!lw->conn->isConnectionClosed) {
+            struct iovec *pIov = iov;
+#ifdef CONFIG_ESPHTTPD_WS_DEFLATE
+            if (lw->priv->deflate && lw->priv->deflate->compressSends) {
+                if (!deflateTried) {
+                    int deflatedLen;
+                    deflateTried = true;
+                    deflated = websockDeflate(lw->priv->registry, data, len, &deflatedLen);
+                    if (deflated) {
+                        deflatedIov[0].iov_base = deflatedHead;
+                        deflatedIov[0].iov_len = encodeFrameHead(deflatedHead, frameOpcode(flags)|FLAG_RSV1, deflatedLen);
+                        deflatedIov[1].iov_base = deflated;
+                        deflatedIov[1].iov_len = deflatedLen;
+                    }
+                }
+                if (deflated) pIov = deflatedIov;
+            }
+#endif
+            int frameLen = pIov[0].iov_len + pIov[1].iov_len;
+            if (lw->priv->queue) {
+                int variant = (pIov == iov) ? 0 : 1;
+                if (queuedFrame[variant] == NULL) {
+                    queuedFrame[variant] = websockFrameNew(*(uint8_t *)pIov[0].iov_base, pIov[1].iov_base, pIov[1].iov_len);
+                }
+                if (queuedFrame[variant] && websockEnqueue(lw, queuedFrame[variant])) {
+                    websockDrain(lw);
+                    ret++;
+                }
+                lw = lw->priv->next;
+                continue;
+            }
+            // a subscriber that stopped reading must not hold up the others, it misses the frame
+            // when its socket is full and is closed when only part of the frame fits
+            int r = websockWriteFrameNonblock(pInstance, lw, pIov, (pIov[1].iov_len != 0) ? 2 : 1);
+            if (r == 0) {
+                ESP_LOGW(TAG, "Broadcast to %s: socket full, %d byte frame dropped", resource, frameLen);
+            } else if (r > 0) {
+                if (flags & WEBSOCK_FLAG_FLUSH) httpdPlatFlushData(pInstance, lw->conn);
+                ret++;
+            }
         }
         lw = lw->priv->next;
     }
+    httpdPlatUnlock(pInstance);
+    for (int variant = 0; variant < 2; variant++) {
+        if (queuedFrame[variant]) kref_put(&queuedFrame[variant]->ref, websockFrameRelease);
+    }
+#ifdef CONFIG_ESPHTTPD_WS_DEFLATE
+    free(deflated);
+#endif
     return ret;
 }
 
@@ -153,33 +1175,46 @@ int MEM_ATTR cgiWebsockBroadcast(HttpdInstance *pInstance, const char *resource,
 void cgiWebsocketClose(HttpdInstance *pInstance, Websock *ws, int reason) {
     char rs[2] = { reason>>8, reason&0xff };
     httpdPlatLock(pInstance);
-    sendFrameHead(ws, FLAG_FIN|OPCODE_CLOSE, 2);
-    httpdSend(ws->conn, rs, 2);
+    websockSendFrame(pInstance, ws, FLAG_FIN|OPCODE_CLOSE, rs, 2, WEBSOCK_FLAG_FLUSH);
     ws->priv->closedHere = 1;
-    httpdFlushSendBuffer(pInstance, ws->conn);
     httpdPlatUnlock(pInstance);
 }
 
 
 static void websockFree(Websock *ws) {
     if (ws->closeCb) ws->closeCb(ws);
-    // Clean up linked list
-    if (llStart == ws) {
-        llStart = ws->priv->next;
-    } else if (llStart) {
-        Websock *lws = llStart;
-        // Find ws that links to this one.
-        while (lws != NULL && lws->priv->next != ws) lws = lws->priv->next;
-        if (lws != NULL) lws->priv->next = ws->priv->next;
+    if (ws->priv) {
+        topicUnsubscribe(ws);
+        websockMsgRelease(ws);
+        websockQueueFree(ws);
+#ifdef CONFIG_ESPHTTPD_WS_DEFLATE
+        if (ws->priv->deflate) {
+            inflateEnd(&ws->priv->deflate->inflater);
+            free(ws->priv->deflate);
+        }
+#endif
+        free(ws->priv);
     }
-    if (ws->priv) free(ws->priv);
+}
+
+//RSV1 marks a compressed message, only valid on the first frame of a data message and only with
+//permessage-deflate negotiated (RFC 7692 section 6.1)
+static bool MEM_ATTR websockRsv1Allowed(Websock *ws, int opcode) {
+#ifdef CONFIG_ESPHTTPD_WS_DEFLATE
+    return ws->priv->deflate && (opcode == OPCODE_TEXT || opcode == OPCODE_BINARY);
+#else
+    return false;
+#endif
 }
 
 CgiStatus MEM_ATTR cgiWebSocketRecv(HttpdInstance *pInstance, HttpdConnData *connData, char *data, int len) {
-    int j, sl;
+    int sl;
     int r = HTTPD_CGI_MORE;
     int wasHeaderByte;
     Websock *ws = (Websock*)connData->cgiData;
+    // anything from the client shows it is alive, not just pongs
+    ws->priv->receivedSinceTick = 1;
+    ws->priv->awaitingPong = 0;
     for (int i = 0; i < len; ++i) {
 //         printf("Ws: State %d byte 0x%02X\n", ws->priv->wsStatus, data[i]);
         wasHeaderByte = 1;
@@ -188,6 +1223,11 @@ CgiStatus MEM_ATTR cgiWebSocketRecv(HttpdInstance *pInstance, HttpdConnData *con
             ws->priv->frameCont = 0;
             ws->priv->fr.flags = (uint8_t)data[i];
             ws->priv->wsStatus = ST_LEN0;
+            if ((ws->priv->fr.flags&FLAG_RSV1) && !websockRsv1Allowed(ws, ws->priv->fr.flags&OPCODE_MASK)) {
+                cgiWebsocketClose(pInstance, ws, 1002);
+                r = HTTPD_CGI_DONE;
+                break;
+            }
         } else if (ws->priv->wsStatus == ST_LEN0) {
             ws->priv->fr.len8 = (uint8_t)data[i];
             if ((ws->priv->fr.len8&127) >= 126) {
@@ -226,7 +1266,7 @@ CgiStatus MEM_ATTR cgiWebSocketRecv(HttpdInstance *pInstance, HttpdConnData *con
             sl = len - i;
             ESP_LOGD(TAG, "Frame payload. wasHeaderByte %d fr.len %d sl %d cmd 0x%x", wasHeaderByte, (int)ws->priv->fr.len, (int)sl, ws->priv->fr.flags);
             if (sl > ws->priv->fr.len) sl = ws->priv->fr.len;
-            for (j = 0; j < sl; ++j) data[i+j]^=(ws->priv->fr.mask[(ws->priv->maskCtr++)&3]);
+            websockUnmask(data+i, sl, ws->priv->fr.mask, &ws->priv->maskCtr);
 
 //			httpd_printf("Unmasked: ");
 //			for (j=0; j<sl; j++) httpd_printf("%02X ", data[i+j]&0xff);
@@ -239,8 +1279,13 @@ CgiStatus MEM_ATTR cgiWebSocketRecv(HttpdInstance *pInstance, HttpdConnData *con
                     r = HTTPD_CGI_DONE;
                     break;
                 } else {
-                    if (!ws->priv->frameCont) sendFrameHead(ws, OPCODE_PONG|FLAG_FIN, ws->priv->fr.len);
-                    if (sl>0) httpdSend(ws->conn, data+i, sl);
+                    // collect the payload, the pong echoes it as one frame
+                    if (!ws->priv->frameCont) ws->priv->pingLen = 0;
+                    memcpy(&ws->priv->pingData[ws->priv->pingLen], data+i, sl);
+                    ws->priv->pingLen += sl;
+                    if (ws->priv->fr.len == sl) {
+                        websockSendFrame(pInstance, ws, OPCODE_PONG|FLAG_FIN, ws->priv->pingData, ws->priv->pingLen, WEBSOCK_FLAG_NONE);
+                    }
                 }
             } else if ((ws->priv->fr.flags&OPCODE_MASK)==OPCODE_TEXT ||
                         (ws->priv->fr.flags&OPCODE_MASK)==OPCODE_BINARY ||
@@ -252,10 +1297,28 @@ CgiStatus MEM_ATTR cgiWebSocketRecv(HttpdInstance *pInstance, HttpdConnData *con
                     r = HTTPD_CGI_DONE;
                     break;
                 } else {
-                    int flags = 0;
-                    if ((ws->priv->fr.flags&OPCODE_MASK) == OPCODE_BINARY) flags|=WEBSOCK_FLAG_BIN;
-                    if ((ws->priv->fr.flags&FLAG_FIN) == 0) flags|=WEBSOCK_FLAG_MORE;
-                    if (ws->recvCb) ws->recvCb(ws, data+i, sl, flags);
+                    // continuation frames carry no type, it comes from the first frame of the message
+                    if ((ws->priv->fr.flags&OPCODE_MASK) != OPCODE_CONTINUE && !ws->priv->frameCont) {
+                        ws->priv->msgOpcode = ws->priv->fr.flags&OPCODE_MASK;
+                        if (ws->priv->msg) ws->priv->msg->len = 0;
+#ifdef CONFIG_ESPHTTPD_WS_DEFLATE
+                        ws->priv->msgCompressed = (ws->priv->fr.flags&FLAG_RSV1) && ws->priv->deflate;
+#endif
+                    }
+                    int flags = (ws->priv->msgOpcode == OPCODE_BINARY) ? WEBSOCK_FLAG_BIN : 0;
+                    bool last = (ws->priv->fr.flags&FLAG_FIN) && ws->priv->fr.len == sl;
+                    int closeCode;
+#ifdef CONFIG_ESPHTTPD_WS_DEFLATE
+                    if (ws->priv->msgCompressed) {
+                        closeCode = websockInflate(ws, data+i, sl, flags, last);
+                    } else
+#endif
+                    closeCode = websockDeliver(ws, data+i, sl, flags, last, ws->priv->frameCont ? 0 : ws->priv->fr.len);
+                    if (closeCode) {
+                        cgiWebsocketClose(pInstance, ws, closeCode);
+                        r = HTTPD_CGI_DONE;
+                        break;
+                    }
                 }
             } else if ((ws->priv->fr.flags&OPCODE_MASK) == OPCODE_CLOSE) {
                 ESP_LOGD(TAG, "Got close frame");
@@ -265,6 +1328,8 @@ CgiStatus MEM_ATTR cgiWebSocketRecv(HttpdInstance *pInstance, HttpdConnData *con
                 }
                 r = HTTPD_CGI_DONE;
                 break;
+            } else if ((ws->priv->fr.flags&OPCODE_MASK) == OPCODE_PONG) {
+                ESP_LOGD(TAG, "Got pong");
             } else {
                 if (!ws->priv->frameCont) ESP_LOGE(TAG, "Unknown opcode 0x%X", ws->priv->fr.flags&OPCODE_MASK);
             }
@@ -331,6 +1396,36 @@ CgiStatus MEM_ATTR cgiWebsocket(HttpdConnData *connData) {
                 }
                 memset(ws->priv, 0, sizeof(WebsockPriv));
                 ws->conn = connData;
+                ws->priv->registry = websockRegistry(connData->instance);
+                //Make ws reachable for broadcasts to its url and for keepalive, before it is announced
+                if (ws->priv->registry == NULL || !topicSubscribe(ws)) {
+                    ESP_LOGE(TAG, "Can't allocate mem for websocket registry");
+                    free(ws->priv);
+                    free(connData->cgiData);
+                    connData->cgiData=NULL;
+                    httpdStartResponse(connData, 500);
+                    httpdEndHeaders(connData);
+                    return HTTPD_CGI_DONE;
+                }
+#ifdef CONFIG_ESPHTTPD_WS_DEFLATE
+                char extensions[160];
+                int clientBits;
+                bool deflate = false;
+                if (httpdGetHeader(connData, "Sec-WebSocket-Extensions", extensions, sizeof(extensions)) &&
+                    websockNegotiateDeflate(extensions, extensions, sizeof(extensions), &clientBits)) {
+                    ws->priv->deflate = malloc(sizeof(WebsockDeflate));
+                    if (ws->priv->deflate) {
+                        memset(&ws->priv->deflate->inflater, 0, sizeof(z_stream));
+                        ws->priv->deflate->compressSends = true;
+                        if (inflateInit2(&ws->priv->deflate->inflater, -clientBits) == Z_OK) {
+                            deflate = true;
+                        } else {
+                            free(ws->priv->deflate);
+                            ws->priv->deflate = NULL;
+                        }
+                    }
+                }
+#endif
                 //Reply with the right headers.
                 strcat(buff, WS_GUID);
                 sha1_init(&s);
@@ -341,20 +1436,15 @@ CgiStatus MEM_ATTR cgiWebsocket(HttpdConnData *connData) {
                 httpdHeader(connData, "Connection", "upgrade");
                 libesphttpd_base64_encode(20, sha1_result(&s), sizeof(buff), buff);
                 httpdHeader(connData, "Sec-WebSocket-Accept", buff);
+#ifdef CONFIG_ESPHTTPD_WS_DEFLATE
+                if (deflate) httpdHeader(connData, "Sec-WebSocket-Extensions", extensions);
+#endif
                 httpdEndHeaders(connData);
                 //Set data receive handler
                 connData->recvHdl = cgiWebSocketRecv;
                 //Inform CGI function we have a connection
                 WsConnectedCb connCb = connData->cgiArg;
                 connCb(ws);
-                //Insert ws into linked list
-                if (llStart == NULL) {
-                    llStart = ws;
-                } else {
-                    Websock *lw = llStart;
-                    while (lw->priv->next) lw = lw->priv->next;
-                    lw->priv->next = ws;
-                }
                 return HTTPD_CGI_MORE;
             }
         }
@@ -364,8 +1454,12 @@ CgiStatus MEM_ATTR cgiWebsocket(HttpdConnData *connData) {
         return HTTPD_CGI_DONE;
     }
 
-    //Sending is done. Call the sent callback if we have one.
+    //Sending is done. Continue with the outbound queue, call the sent callback once it is empty.
     Websock *ws = (Websock*)connData->cgiData;
+    if (ws && ws->priv->queue) {
+        websockDrain(ws);
+        if (ws->priv->queue->head != NULL) return HTTPD_CGI_MORE;
+    }
     if (ws && ws->sentCb) ws->sentCb(ws);
 
     return HTTPD_CGI_MORE;
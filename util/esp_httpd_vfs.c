@@ -7,14 +7,19 @@ Connector to let httpd use the vfs filesystem to serve the files in it.
 */
 
 #include <stdio.h>
+#include <limits.h>
 #include <string.h>
 #include <sys/unistd.h>
 #include <sys/stat.h>
 #include <sys/errno.h>
 #include "esp_err.h"
 #include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_heap_caps.h"
 #include "libesphttpd/esp.h"
 #include "libesphttpd/httpd.h"
+#include "libesphttpd/esp_httpd_vfs.h"
+#include "libesphttpd/kref.h"
 #include "cJSON.h"
 
 #define FILE_CHUNK_LEN    (1024)
@@ -26,6 +31,634 @@ Connector to let httpd use the vfs filesystem to serve the files in it.
 
 char base_path[BASE_PATH_MAX_LENGTH];
 
+#ifndef CONFIG_ESPHTTPD_VFS_CACHE_ENTRIES
+#define CONFIG_ESPHTTPD_VFS_CACHE_ENTRIES 0
+#endif
+
+#ifndef CONFIG_ESPHTTPD_VFS_CONTENT_CACHE_SIZE
+#define CONFIG_ESPHTTPD_VFS_CONTENT_CACHE_SIZE 0
+#endif
+
+#ifndef CONFIG_ESPHTTPD_TPL_CACHE_ENTRIES
+#define CONFIG_ESPHTTPD_TPL_CACHE_ENTRIES 0
+#endif
+
+//Most ranges cgiEspVfsGet answers with a multipart response, more get the whole file
+#ifndef VFS_MAX_RANGES
+#define VFS_MAX_RANGES 8
+#endif
+
+//What a url resolved to
+typedef struct {
+    char path[MAX_FILENAME_LENGTH + 1];
+    long size;
+    time_t mtime;
+    bool isGzip;        // send with Content-Encoding: gzip
+    bool gzFallback;    // path is the .gz file found instead of a missing one, the client has to accept gzip
+    const char *mimetype;
+} VfsFileInfo;
+
+//FNV-1a of the url, mixed with the route arguments that decide where it maps to
+static uint32_t MEM_ATTR vfsCacheHash(HttpdConnData *connData) {
+    uint32_t hash = 2166136261u;
+    for (const char *p = connData->url; *p; p++) {
+        hash ^= (uint8_t)*p;
+        hash *= 16777619u;
+    }
+    hash ^= (uint32_t)(uintptr_t)connData->cgiArg;
+    hash *= 16777619u;
+    hash ^= (uint32_t)(uintptr_t)connData->cgiArg2;
+    hash *= 16777619u;
+    return hash;
+}
+
+//The validators are the modification time and size, without a modification time (SPIFFS without
+//CONFIG_SPIFFS_USE_MTIME) there are none and this returns NULL.
+static const char* MEM_ATTR vfsEtag(char *etag, size_t len, time_t mtime, long size) {
+    if (mtime == 0) return NULL;
+    snprintf(etag, len, "\"%lx-%lx\"", (unsigned long)mtime, (unsigned long)size);
+    return etag;
+}
+
+//Answer 304 if the client's copy is current
+static bool MEM_ATTR vfsNotModified(HttpdConnData *connData, time_t mtime, long size) {
+    char etag[24];
+    if (vfsEtag(etag, sizeof(etag), mtime, size) == NULL) return false;
+    if (!httpdIsNotModified(connData, etag, mtime)) return false;
+    httpdSendNotModified(connData, etag, mtime);
+    return true;
+}
+
+static void MEM_ATTR vfsValidatorHeaders(HttpdConnData *connData, time_t mtime, long size) {
+    char etag[24];
+    if (vfsEtag(etag, sizeof(etag), mtime, size) == NULL) return;
+    httpdValidatorHeaders(connData, etag, mtime);
+}
+
+//Whether cached path is affected by invalidating inv: the file itself, its .gz variant, or anything
+//below it when inv is a directory. NULL invalidates everything.
+static inline bool vfsPathInvalidated(const char *path, const char *inv) {
+    if (inv == NULL) return true;
+    int invLen = strlen(inv);
+    if (strncmp(path, inv, invLen) != 0) return false;
+    const char *rest = path + invLen;
+    return *rest == '\0' || strcmp(rest, ".gz") == 0 || *rest == '/' || (invLen > 0 && inv[invLen - 1] == '/');
+}
+
+typedef struct VfsContent VfsContent;
+
+//State of a cgiEspVfsGet response while the file is being sent
+typedef struct {
+    FILE *file;             // NULL when the body comes from the content cache
+    VfsContent *content;    // referenced until its body is out
+    HttpdDirectSend direct; // of content
+    long remaining;         // of the current range, LONG_MAX when sending the whole file
+    int part;               // next range to send
+    int rangeCount;         // 0 for the whole file, more than 1 for multipart/byteranges
+    long size;
+    const char *mimetype;   // of the parts
+    char boundary[32];
+    HttpdRange ranges[VFS_MAX_RANGES];
+} VfsSendState;
+
+#if CONFIG_ESPHTTPD_VFS_CONTENT_CACHE_SIZE > 0
+#ifdef CONFIG_ESPHTTPD_VFS_CONTENT_CACHE_PSRAM
+#define VFS_CONTENT_CAPS MALLOC_CAP_SPIRAM
+#else
+#define VFS_CONTENT_CAPS MALLOC_CAP_8BIT
+#endif
+
+#ifndef VFS_CONTENT_BUCKETS
+#define VFS_CONTENT_BUCKETS 16
+#endif
+
+//Most cached bytes offered to the socket per cgi call, the rest goes out from the sent callback
+#ifndef VFS_CONTENT_SLICE_LEN
+#define VFS_CONTENT_SLICE_LEN 4096
+#endif
+
+//Whole file kept in RAM, with the response headers that only depend on the file and the route.
+//Referenced while it is being sent, so it can be evicted at any time.
+struct VfsContent {
+    struct kref ref;
+    VfsContent *next;   // in hash bucket
+    VfsContent *newer;  // LRU list
+    VfsContent *older;
+    uint32_t hash;
+    const void *cgiArg;
+    const void *cgiArg2;
+    bool gzFallback;
+    time_t mtime;
+    int cost;           // bytes counted against the budget
+    int headersLen;
+    int len;
+    char *headers;
+    char *data;
+    char *path;
+    char url[];
+};
+
+static VfsContent *vfsContentBuckets[VFS_CONTENT_BUCKETS];
+static VfsContent *vfsContentNewest;
+static VfsContent *vfsContentOldest;
+static EspVfsContentCacheStats vfsContentStats;
+static portMUX_TYPE vfsContentMux = portMUX_INITIALIZER_UNLOCKED;
+
+static void MEM_ATTR vfsContentRelease(struct kref *ref) {
+    free(kcontainer_of(ref, VfsContent, ref));
+}
+
+static VfsContent* MEM_ATTR vfsContentFind(HttpdConnData *connData, uint32_t hash) {
+    VfsContent *c = vfsContentBuckets[hash % VFS_CONTENT_BUCKETS];
+    while (c != NULL) {
+        if (c->hash == hash && c->cgiArg == connData->cgiArg && c->cgiArg2 == connData->cgiArg2 &&
+            strcmp(c->url, connData->url) == 0) break;
+        c = c->next;
+    }
+    return c;
+}
+
+static void MEM_ATTR vfsContentLinkNewest(VfsContent *c) {
+    c->older = vfsContentNewest;
+    c->newer = NULL;
+    if (vfsContentNewest) vfsContentNewest->newer = c;
+    vfsContentNewest = c;
+    if (vfsContentOldest == NULL) vfsContentOldest = c;
+}
+
+static void MEM_ATTR vfsContentUnlinkLru(VfsContent *c) {
+    if (c->newer) c->newer->older = c->older; else vfsContentNewest = c->older;
+    if (c->older) c->older->newer = c->newer; else vfsContentOldest = c->newer;
+}
+
+//Take c out of the cache, the caller drops the cache's reference after leaving the critical section
+static void MEM_ATTR vfsContentUnlink(VfsContent *c) {
+    VfsContent **pC = &vfsContentBuckets[c->hash % VFS_CONTENT_BUCKETS];
+    while (*pC != c) pC = &(*pC)->next;
+    *pC = c->next;
+    vfsContentUnlinkLru(c);
+    vfsContentStats.entries--;
+    vfsContentStats.bytes -= c->cost;
+}
+
+//Cached contents for the request, referenced, or NULL
+static VfsContent* MEM_ATTR vfsContentGet(HttpdConnData *connData, uint32_t hash) {
+    portENTER_CRITICAL(&vfsContentMux);
+    VfsContent *c = vfsContentFind(connData, hash);
+    if (c != NULL) {
+        kref_get(&c->ref);
+        vfsContentUnlinkLru(c);
+        vfsContentLinkNewest(c);
+        vfsContentStats.hits++;
+    } else {
+        vfsContentStats.misses++;
+    }
+    portEXIT_CRITICAL(&vfsContentMux);
+    return c;
+}
+
+//Read all of file into the cache, making room by evicting the least recently used contents.
+//Returns the new contents, referenced, or NULL with file rewound when it wasn't cached.
+static VfsContent* MEM_ATTR vfsContentInsert(HttpdConnData *connData, uint32_t hash, const VfsFileInfo *info, FILE *file,
+                                             const char *headers, int headersLen) {
+    int urlLen = strlen(connData->url) + 1;
+    int pathLen = strlen(info->path) + 1;
+    int cost = sizeof(VfsContent) + urlLen + pathLen + headersLen + info->size;
+    if (info->size > CONFIG_ESPHTTPD_VFS_CONTENT_CACHE_MAX_FILE || cost > CONFIG_ESPHTTPD_VFS_CONTENT_CACHE_SIZE) return NULL;
+
+    VfsContent *c = heap_caps_malloc(cost, VFS_CONTENT_CAPS);
+    if (c == NULL) return NULL;
+    kref_init(&c->ref);
+    c->hash = hash;
+    c->cgiArg = connData->cgiArg;
+    c->cgiArg2 = connData->cgiArg2;
+    c->gzFallback = info->gzFallback;
+    c->mtime = info->mtime;
+    c->cost = cost;
+    memcpy(c->url, connData->url, urlLen);
+    c->path = &c->url[urlLen];
+    memcpy(c->path, info->path, pathLen);
+    c->headers = &c->path[pathLen];
+    c->headersLen = headersLen;
+    memcpy(c->headers, headers, headersLen);
+    c->data = &c->headers[headersLen];
+    c->len = fread(c->data, 1, info->size, file);
+    if (c->len != info->size || fgetc(file) != EOF) {
+        // changed since it was looked up, serve it the usual way
+        fseek(file, 0, SEEK_SET);
+        free(c);
+        return NULL;
+    }
+
+    VfsContent *victims = NULL;
+    portENTER_CRITICAL(&vfsContentMux);
+    VfsContent *old = vfsContentFind(connData, hash);
+    if (old != NULL) {
+        vfsContentUnlink(old);
+        old->next = victims;
+        victims = old;
+    }
+    while (vfsContentStats.bytes + cost > CONFIG_ESPHTTPD_VFS_CONTENT_CACHE_SIZE) {
+        VfsContent *victim = vfsContentOldest;
+        vfsContentUnlink(victim);
+        victim->next = victims;
+        victims = victim;
+        vfsContentStats.evictions++;
+    }
+    c->next = vfsContentBuckets[hash % VFS_CONTENT_BUCKETS];
+    vfsContentBuckets[hash % VFS_CONTENT_BUCKETS] = c;
+    vfsContentLinkNewest(c);
+    vfsContentStats.entries++;
+    vfsContentStats.bytes += cost;
+    kref_get(&c->ref);
+    portEXIT_CRITICAL(&vfsContentMux);
+
+    while (victims != NULL) {
+        VfsContent *next = victims->next;
+        kref_put(&victims->ref, vfsContentRelease);
+        victims = next;
+    }
+    return c;
+}
+
+static void MEM_ATTR vfsContentInvalidate(const char *path) {
+    VfsContent *dropped = NULL;
+    portENTER_CRITICAL(&vfsContentMux);
+    VfsContent *c = vfsContentNewest;
+    while (c != NULL) {
+        VfsContent *older = c->older;
+        if (vfsPathInvalidated(c->path, path)) {
+            vfsContentUnlink(c);
+            c->next = dropped;
+            dropped = c;
+        }
+        c = older;
+    }
+    portEXIT_CRITICAL(&vfsContentMux);
+    while (dropped != NULL) {
+        VfsContent *next = dropped->next;
+        kref_put(&dropped->ref, vfsContentRelease);
+        dropped = next;
+    }
+}
+
+void MEM_ATTR cgiEspVfsContentCacheStats(EspVfsContentCacheStats *stats) {
+    portENTER_CRITICAL(&vfsContentMux);
+    *stats = vfsContentStats;
+    portEXIT_CRITICAL(&vfsContentMux);
+}
+
+static void MEM_ATTR vfsContentPut(VfsContent *c) {
+    kref_put(&c->ref, vfsContentRelease);
+}
+
+static bool MEM_ATTR vfsContentGzFallback(VfsContent *c) {
+    return c->gzFallback;
+}
+
+static bool MEM_ATTR vfsContentNotModified(HttpdConnData *connData, VfsContent *c) {
+    return vfsNotModified(connData, c->mtime, c->len);
+}
+
+//Write as much of a cached body as the socket takes without blocking, the reference is
+//dropped once it is out
+static CgiStatus MEM_ATTR vfsContentSend(HttpdConnData *connData, VfsSendState *state) {
+    int r = httpdSendDirectNonblock(connData->instance, connData, &state->direct, VFS_CONTENT_SLICE_LEN);
+    if (r == 0) {
+        // the sent callback calls us again once the socket has room
+        return HTTPD_CGI_MORE;
+    }
+    if (r < 0) ESP_LOGE(__func__, "sending %s failed", connData->url);
+    vfsContentPut(state->content);
+    free(state);
+    connData->cgiData = NULL;
+    return HTTPD_CGI_DONE;
+}
+
+//Send a response from cached contents, the body straight from the cache. Takes over the reference.
+static CgiStatus MEM_ATTR vfsContentServe(HttpdConnData *connData, VfsContent *c) {
+    VfsSendState *state = malloc(sizeof(VfsSendState));
+    if (state == NULL) {
+        ESP_LOGE(__func__, "Can't allocate send state");
+        vfsContentPut(c);
+        return HTTPD_CGI_DONE;
+    }
+    state->file = NULL;
+    state->content = c;
+    connData->cgiData = state;
+
+    httpdStartResponse(connData, 200);
+    httpdSend(connData, c->headers, c->headersLen);
+    if (connData->cgiArg == &httpdCgiEx && ((HttpdCgiExArg *)connData->cgiArg2)->headerCb) {
+        ((HttpdCgiExArg *)connData->cgiArg2)->headerCb(connData);
+    }
+    httpdEndHeaders(connData);
+    httpdSendDirectStart(connData->instance, connData, &state->direct, c->data, c->len);
+    return vfsContentSend(connData, state);
+}
+#else
+static inline VfsContent* vfsContentGet(HttpdConnData *connData, uint32_t hash) { return NULL; }
+static inline VfsContent* vfsContentInsert(HttpdConnData *connData, uint32_t hash, const VfsFileInfo *info, FILE *file,
+                                           const char *headers, int headersLen) { return NULL; }
+static inline void vfsContentInvalidate(const char *path) { }
+static inline CgiStatus vfsContentServe(HttpdConnData *connData, VfsContent *c) { return HTTPD_CGI_DONE; }
+static inline CgiStatus vfsContentSend(HttpdConnData *connData, VfsSendState *state) { return HTTPD_CGI_DONE; }
+static inline void vfsContentPut(VfsContent *c) { }
+static inline bool vfsContentGzFallback(VfsContent *c) { return false; }
+static inline bool vfsContentNotModified(HttpdConnData *connData, VfsContent *c) { return false; }
+void cgiEspVfsContentCacheStats(EspVfsContentCacheStats *stats) { memset(stats, 0, sizeof(*stats)); }
+#endif
+
+//A template split once into literal runs, each followed by a token, so rendering doesn't scan it
+typedef struct {
+    uint32_t litOffset;
+    uint32_t litLen;
+    int32_t tokenOffset;    // zero-terminated token name in text, -1 for none
+} TplSegment;
+
+typedef struct {
+    struct kref ref;
+    time_t mtime;
+    long size;
+    uint32_t lastUse;
+    int segmentCount;
+    TplSegment *segments;
+    char *text;             // literals with %% unescaped, and the token names
+    char path[];
+} TplCompiled;
+
+#if CONFIG_ESPHTTPD_TPL_CACHE_ENTRIES > 0
+
+static TplCompiled *tplCache[CONFIG_ESPHTTPD_TPL_CACHE_ENTRIES];
+static uint32_t tplCacheTick;
+static portMUX_TYPE tplCacheMux = portMUX_INITIALIZER_UNLOCKED;
+
+static void MEM_ATTR tplRelease(struct kref *ref) {
+    free(kcontainer_of(ref, TplCompiled, ref));
+}
+
+static void MEM_ATTR tplPut(TplCompiled *tpl) {
+    kref_put(&tpl->ref, tplRelease);
+}
+
+//Split the template in text, in place: a literal never grows, so the output stays behind the input
+static int MEM_ATTR tplCompileText(char *text, int len, TplSegment *segments) {
+    int count = 0;
+    int w = 0, r = 0;
+    segments[0].litOffset = 0;
+    while (r < len) {
+        if (text[r] != '%') {
+            text[w++] = text[r++];
+            continue;
+        }
+        char *end = memchr(&text[r + 1], '%', len - r - 1);
+        if (end == NULL) {
+            // unterminated token at the end, dropped
+            break;
+        }
+        int tokenLen = end - &text[r + 1];
+        if (tokenLen == 0) {
+            // %% escape
+            text[w++] = '%';
+            r += 2;
+            continue;
+        }
+        TplSegment *seg = &segments[count++];
+        seg->litLen = w - seg->litOffset;
+        seg->tokenOffset = w;
+        memmove(&text[w], &text[r + 1], tokenLen);
+        w += tokenLen;
+        text[w++] = '\0';
+        r += tokenLen + 2;
+        segments[count].litOffset = w;
+    }
+    segments[count].litLen = w - segments[count].litOffset;
+    segments[count].tokenOffset = -1;
+    return count + 1;
+}
+
+//Read and split the template at path. Returns it referenced, or NULL if it can't be cached.
+static TplCompiled* MEM_ATTR tplCompile(const char *path, const struct stat *st) {
+    if (st->st_size > CONFIG_ESPHTTPD_TPL_CACHE_MAX_FILE) return NULL;
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return NULL;
+
+    // count the %s first, each token takes two
+    int percents = 0;
+    int c;
+    while ((c = fgetc(file)) != EOF) {
+        if (c == '%') percents++;
+    }
+    int pathLen = strlen(path) + 1;
+    int pathSize = (pathLen + 3) & ~3; // segments are aligned
+    int maxSegments = percents / 2 + 1;
+    TplCompiled *tpl = malloc(sizeof(TplCompiled) + pathSize + maxSegments * sizeof(TplSegment) + st->st_size);
+    if (tpl == NULL) {
+        fclose(file);
+        return NULL;
+    }
+    kref_init(&tpl->ref);
+    tpl->mtime = st->st_mtime;
+    tpl->size = st->st_size;
+    memcpy(tpl->path, path, pathLen);
+    tpl->segments = (TplSegment *)&tpl->path[pathSize];
+    tpl->text = (char *)&tpl->segments[maxSegments];
+
+    rewind(file);
+    int len = fread(tpl->text, 1, st->st_size, file);
+    fclose(file);
+    if (len != st->st_size) {
+        free(tpl);
+        return NULL;
+    }
+    tpl->segmentCount = tplCompileText(tpl->text, len, tpl->segments);
+    return tpl;
+}
+
+//Compiled template for path, compiled now if it isn't cached or changed. Returns it referenced.
+static TplCompiled* MEM_ATTR tplCacheGet(const char *path, const struct stat *st) {
+    TplCompiled *tpl = NULL;
+    portENTER_CRITICAL(&tplCacheMux);
+    for (int i = 0; i < CONFIG_ESPHTTPD_TPL_CACHE_ENTRIES; i++) {
+        TplCompiled *t = tplCache[i];
+        if (t != NULL && t->mtime == st->st_mtime && t->size == st->st_size && strcmp(t->path, path) == 0) {
+            tpl = t;
+            tpl->lastUse = ++tplCacheTick;
+            kref_get(&tpl->ref);
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&tplCacheMux);
+    if (tpl != NULL) return tpl;
+
+    tpl = tplCompile(path, st);
+    if (tpl == NULL) return NULL;
+
+    // take the slot of an older version, else of the least recently used
+    TplCompiled *dropped = NULL;
+    portENTER_CRITICAL(&tplCacheMux);
+    int slot = 0;
+    for (int i = 0; i < CONFIG_ESPHTTPD_TPL_CACHE_ENTRIES; i++) {
+        if (tplCache[i] == NULL || strcmp(tplCache[i]->path, path) == 0) {
+            slot = i;
+            break;
+        }
+        if (tplCache[i]->lastUse < tplCache[slot]->lastUse) slot = i;
+    }
+    dropped = tplCache[slot];
+    tpl->lastUse = ++tplCacheTick;
+    kref_get(&tpl->ref);
+    tplCache[slot] = tpl;
+    portEXIT_CRITICAL(&tplCacheMux);
+    if (dropped != NULL) tplPut(dropped);
+    return tpl;
+}
+
+static void MEM_ATTR tplCacheInvalidate(const char *path) {
+    TplCompiled *dropped[CONFIG_ESPHTTPD_TPL_CACHE_ENTRIES];
+    int count = 0;
+    portENTER_CRITICAL(&tplCacheMux);
+    for (int i = 0; i < CONFIG_ESPHTTPD_TPL_CACHE_ENTRIES; i++) {
+        if (tplCache[i] != NULL && vfsPathInvalidated(tplCache[i]->path, path)) {
+            dropped[count++] = tplCache[i];
+            tplCache[i] = NULL;
+        }
+    }
+    portEXIT_CRITICAL(&tplCacheMux);
+    while (count > 0) tplPut(dropped[--count]);
+}
+#else
+static inline TplCompiled* tplCacheGet(const char *path, const struct stat *st) { return NULL; }
+static inline void tplPut(TplCompiled *tpl) { }
+static inline void tplCacheInvalidate(const char *path) { }
+#endif
+
+#if CONFIG_ESPHTTPD_VFS_CACHE_ENTRIES > 0
+typedef struct VfsCacheEntry VfsCacheEntry;
+
+//Cached resolution of a url served by one route
+struct VfsCacheEntry {
+    VfsCacheEntry *next; // in hash bucket
+    uint32_t hash;
+    uint32_t lastUse;
+    const void *cgiArg;
+    const void *cgiArg2;
+    long size;
+    time_t mtime;
+    bool isGzip;
+    bool gzFallback;
+    const char *mimetype;
+    char *path; // follows url
+    char url[];
+};
+
+// The cache is shared by all server tasks. Entries are allocated and freed outside the spinlock.
+static VfsCacheEntry *vfsCache[CONFIG_ESPHTTPD_VFS_CACHE_ENTRIES];
+static int vfsCacheCount;
+static uint32_t vfsCacheTick;
+static portMUX_TYPE vfsCacheMux = portMUX_INITIALIZER_UNLOCKED;
+
+static VfsCacheEntry* MEM_ATTR vfsCacheFind(HttpdConnData *connData, uint32_t hash) {
+    VfsCacheEntry *e = vfsCache[hash % CONFIG_ESPHTTPD_VFS_CACHE_ENTRIES];
+    while (e != NULL) {
+        if (e->hash == hash && e->cgiArg == connData->cgiArg && e->cgiArg2 == connData->cgiArg2 &&
+            strcmp(e->url, connData->url) == 0) break;
+        e = e->next;
+    }
+    return e;
+}
+
+static bool MEM_ATTR vfsCacheLookup(HttpdConnData *connData, uint32_t hash, VfsFileInfo *info) {
+    portENTER_CRITICAL(&vfsCacheMux);
+    VfsCacheEntry *e = vfsCacheFind(connData, hash);
+    if (e != NULL) {
+        e->lastUse = ++vfsCacheTick;
+        strlcpy(info->path, e->path, sizeof(info->path));
+        info->size = e->size;
+        info->mtime = e->mtime;
+        info->isGzip = e->isGzip;
+        info->gzFallback = e->gzFallback;
+        info->mimetype = e->mimetype;
+    }
+    portEXIT_CRITICAL(&vfsCacheMux);
+    return e != NULL;
+}
+
+static void MEM_ATTR vfsCacheInsert(HttpdConnData *connData, uint32_t hash, const VfsFileInfo *info) {
+    int urlLen = strlen(connData->url) + 1;
+    VfsCacheEntry *e = malloc(sizeof(VfsCacheEntry) + urlLen + strlen(info->path) + 1);
+    if (e == NULL) return;
+    e->hash = hash;
+    e->cgiArg = connData->cgiArg;
+    e->cgiArg2 = connData->cgiArg2;
+    e->size = info->size;
+    e->mtime = info->mtime;
+    e->isGzip = info->isGzip;
+    e->gzFallback = info->gzFallback;
+    e->mimetype = info->mimetype;
+    memcpy(e->url, connData->url, urlLen);
+    e->path = &e->url[urlLen];
+    strcpy(e->path, info->path);
+
+    VfsCacheEntry *victim = NULL;
+    portENTER_CRITICAL(&vfsCacheMux);
+    if (vfsCacheFind(connData, hash) != NULL) {
+        // another server task got here first
+        victim = e;
+    } else {
+        if (vfsCacheCount == CONFIG_ESPHTTPD_VFS_CACHE_ENTRIES) {
+            // full, evict the least recently used entry
+            VfsCacheEntry **pVictim = NULL;
+            for (int bucket = 0; bucket < CONFIG_ESPHTTPD_VFS_CACHE_ENTRIES; bucket++) {
+                for (VfsCacheEntry **pE = &vfsCache[bucket]; *pE != NULL; pE = &(*pE)->next) {
+                    if (pVictim == NULL || (int32_t)((*pE)->lastUse - (*pVictim)->lastUse) < 0) pVictim = pE;
+                }
+            }
+            victim = *pVictim;
+            *pVictim = victim->next;
+        } else {
+            vfsCacheCount++;
+        }
+        e->lastUse = ++vfsCacheTick;
+        e->next = vfsCache[hash % CONFIG_ESPHTTPD_VFS_CACHE_ENTRIES];
+        vfsCache[hash % CONFIG_ESPHTTPD_VFS_CACHE_ENTRIES] = e;
+    }
+    portEXIT_CRITICAL(&vfsCacheMux);
+    free(victim);
+}
+
+void MEM_ATTR cgiEspVfsCacheInvalidate(const char *path) {
+    vfsContentInvalidate(path);
+    tplCacheInvalidate(path);
+    VfsCacheEntry *dropped = NULL;
+    portENTER_CRITICAL(&vfsCacheMux);
+    for (int bucket = 0; bucket < CONFIG_ESPHTTPD_VFS_CACHE_ENTRIES; bucket++) {
+        VfsCacheEntry **pE = &vfsCache[bucket];
+        while (*pE != NULL) {
+            VfsCacheEntry *e = *pE;
+            if (vfsPathInvalidated(e->path, path)) {
+                *pE = e->next;
+                e->next = dropped;
+                dropped = e;
+                vfsCacheCount--;
+            } else {
+                pE = &e->next;
+            }
+        }
+    }
+    portEXIT_CRITICAL(&vfsCacheMux);
+    while (dropped != NULL) {
+        VfsCacheEntry *next = dropped->next;
+        free(dropped);
+        dropped = next;
+    }
+}
+#else
+static inline bool vfsCacheLookup(HttpdConnData *connData, uint32_t hash, VfsFileInfo *info) { return false; }
+static inline void vfsCacheInsert(HttpdConnData *connData, uint32_t hash, const VfsFileInfo *info) { }
+void cgiEspVfsCacheInvalidate(const char *path) { vfsContentInvalidate(path); tplCacheInvalidate(path); }
+#endif
+
 // If the client does not advertise that he accepts GZIP send following warning message (telnet users for e.g.)
 static const char *gzipNonSupportedMessage = "HTTP/1.0 501 Not implemented\r\nServer: libesphttpd/"HTTPDVER"\r\nConnection: close\r\nContent-Type: text/plain\r\nContent-Length: 52\r\n\r\nYour browser does not accept gzip-compressed data.\r\n";
 
@@ -89,85 +722,194 @@ static size_t MEM_ATTR getFilepath(HttpdConnData *connData, char *filepath, size
     return outlen;
 }
 
-CgiStatus MEM_ATTR cgiEspVfsGet(HttpdConnData *connData) {
-    FILE *file = connData->cgiData;
-    int len;
-    char buff[FILE_CHUNK_LEN];
-    char filename[MAX_FILENAME_LENGTH + 1];
-    char acceptEncodingBuffer[64];
-    int isGzip;
+//Find the file for the request and open it: the path itself, index.html for a directory or the .gz
+//variant. Fills in info, returns NULL when there is no such file.
+static FILE* MEM_ATTR vfsResolve(HttpdConnData *connData, VfsFileInfo *info) {
+    char *filename = info->path;
     bool isIndex = false;
     struct stat filestat;
+    FILE *file;
+
+    getFilepath(connData, filename, sizeof(info->path));
+
+    if(filename[strlen(filename)-1]=='/') filename[strlen(filename)-1]='\0';
+    if(stat(filename, &filestat) == 0) {
+        if((isIndex = S_ISDIR(filestat.st_mode))) {
+            strncat(filename, "/index.html", MAX_FILENAME_LENGTH - strlen(filename));
+        }
+    }
+
+    info->gzFallback = false;
+    file = fopen(filename, "r");
+    if (file == NULL) {
+        // Check if requested file is available GZIP compressed ie. with file extension .gz
+        strncat(filename, ".gz", MAX_FILENAME_LENGTH - strlen(filename));
+        ESP_LOGD(__func__, "GET: GZIPped file - %s", filename);
+        file = fopen(filename, "r");
+        if (file == NULL) {
+            return NULL;
+        }
+        info->gzFallback = true;
+    }
+    ESP_LOGD(__func__, "fopen: %s, r", filename);
+
+    struct stat st = {};
+    fstat(fileno(file), &st);
+    info->size = st.st_size;
+    info->mtime = st.st_mtime;
+    info->isGzip = info->gzFallback || (st.st_spare4[0] == ESPFS_MAGIC && st.st_spare4[1] & ESPFS_FLAG_GZIP);
+    info->mimetype = isIndex ? httpdGetMimetype("index.html") : httpdGetMimetype(connData->url);
+    return file;
+}
+
+//Check the browser's "Accept-Encoding" header. If the client does not advertise that it
+//accepts GZIP send a warning message (telnet users for e.g.)
+static bool MEM_ATTR vfsAcceptsGzip(HttpdConnData *connData) {
+    char acceptEncodingBuffer[64];
+    acceptEncodingBuffer[0] = '\0';
+    httpdGetHeader(connData, "Accept-Encoding", acceptEncodingBuffer, sizeof(acceptEncodingBuffer));
+    if (strstr(acceptEncodingBuffer, "gzip") == NULL) {
+        //No Accept-Encoding: gzip header present
+        httpdSend(connData, gzipNonSupportedMessage, -1);
+        ESP_LOGE(__func__, "client does not accept gzip!");
+        return false;
+    }
+    return true;
+}
+
+static void MEM_ATTR vfsSendFree(VfsSendState *state) {
+    if (state->file) fclose(state->file);
+    if (state->content) vfsContentPut(state->content);
+    free(state);
+}
+
+//Start the next part of a multipart/byteranges response, or end it. Returns false when there
+//is no room left in the send buffer for now.
+static bool MEM_ATTR vfsSendPartHeader(HttpdConnData *connData, VfsSendState *state) {
+    char buff[192];
+    if (state->part == state->rangeCount) {
+        snprintf(buff, sizeof(buff), "\r\n--%s--\r\n", state->boundary);
+    } else {
+        const HttpdRange *r = &state->ranges[state->part];
+        snprintf(buff, sizeof(buff), "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                 state->boundary, state->mimetype, r->start, r->end, state->size);
+    }
+    return httpdSend(connData, buff, -1) != 0;
+}
+
+CgiStatus MEM_ATTR cgiEspVfsGet(HttpdConnData *connData) {
+    VfsSendState *state = connData->cgiData;
+    FILE *file = NULL;
+    int len;
+    VfsFileInfo info;
 
     if (connData->isConnectionClosed) {
         //Connection aborted. Clean up.
-        if(file != NULL) {
-            fclose(file);
-            ESP_LOGD(__func__, "fclose: %s, r", filename);
+        if(state != NULL) {
+            vfsSendFree(state);
+            ESP_LOGD(__func__, "fclose: %s", connData->url);
         }
         ESP_LOGE(__func__, "Connection aborted!");
         return HTTPD_CGI_DONE;
     }
 
     //First call to this cgi.
-    if (file == NULL) {
-        isGzip = 0;
+    if (state == NULL) {
         if (connData->requestType!=HTTPD_METHOD_GET) {
             return HTTPD_CGI_NOTFOUND;  //	return and allow another cgi function to handle it
         }
 
-        getFilepath(connData, filename, sizeof(filename));
-
-        if(filename[strlen(filename)-1]=='/') filename[strlen(filename)-1]='\0';
-        if(stat(filename, &filestat) == 0) {
-            if((isIndex = S_ISDIR(filestat.st_mode))) {
-                strncat(filename, "/index.html", MAX_FILENAME_LENGTH - strlen(filename));
+        // Small hot files are served from RAM without touching the filesystem. Range requests
+        // are answered from the file.
+        char rangeHeader[8];
+        bool hasRange = httpdGetHeader(connData, "Range", rangeHeader, sizeof(rangeHeader));
+        uint32_t hash = vfsCacheHash(connData);
+        VfsContent *content = hasRange ? NULL : vfsContentGet(connData, hash);
+        if (content != NULL) {
+            if (vfsContentNotModified(connData, content)) {
+                vfsContentPut(content);
+                return HTTPD_CGI_DONE;
             }
+            if (vfsContentGzFallback(content) && !vfsAcceptsGzip(connData)) {
+                vfsContentPut(content);
+                return HTTPD_CGI_DONE;
+            }
+            return vfsContentServe(connData, content);
         }
 
-        file = fopen(filename, "r");
-        if (file != NULL) {
-            struct stat st = {};
-            fstat(fileno(file), &st);
-            isGzip = (st.st_spare4[0] == ESPFS_MAGIC && st.st_spare4[1] & ESPFS_FLAG_GZIP);
-            ESP_LOGD(__func__, "fopen: %s, r", filename);
+        // A cached url opens straight away, anything else goes through the stat()s.
+        // Revalidations of a cached url don't open the file at all.
+        if (vfsCacheLookup(connData, hash, &info)) {
+            if (vfsNotModified(connData, info.mtime, info.size)) {
+                return HTTPD_CGI_DONE;
+            }
+            file = fopen(info.path, "r");
+            if (file == NULL) {
+                // gone behind our back
+                cgiEspVfsCacheInvalidate(info.path);
+            }
         }
-
         if (file == NULL) {
-            // Check if requested file is available GZIP compressed ie. with file extension .gz
-
-            strncat(filename, ".gz", MAX_FILENAME_LENGTH - strlen(filename));
-            ESP_LOGD(__func__, "GET: GZIPped file - %s", filename);
-            file = fopen(filename, "r");
-            if (file != NULL) ESP_LOGD(__func__, "fopen: %s, r", filename);
-            isGzip = 1;
-
+            file = vfsResolve(connData, &info);
             if (file == NULL) {
                 return HTTPD_CGI_NOTFOUND;
             }
-
-            // Check the browser's "Accept-Encoding" header. If the client does not
-            // advertise that he accepts GZIP send a warning message (telnet users for e.g.)
-            httpdGetHeader(connData, "Accept-Encoding", acceptEncodingBuffer, 64);
-            if (strstr(acceptEncodingBuffer, "gzip") == NULL) {
-                //No Accept-Encoding: gzip header present
-                httpdSend(connData, gzipNonSupportedMessage, -1);
+            vfsCacheInsert(connData, hash, &info);
+            if (vfsNotModified(connData, info.mtime, info.size)) {
                 fclose(file);
-                ESP_LOGD(__func__, "fclose: %s, r", filename);
-                ESP_LOGE(__func__, "client does not accept gzip!");
                 return HTTPD_CGI_DONE;
             }
         }
 
-        connData->cgiData=file;
-        httpdStartResponse(connData, 200);
+        if (info.gzFallback && !vfsAcceptsGzip(connData)) {
+            fclose(file);
+            ESP_LOGD(__func__, "fclose: %s, r", info.path);
+            return HTTPD_CGI_DONE;
+        }
+
+        state = malloc(sizeof(VfsSendState));
+        if (state == NULL) {
+            ESP_LOGE(__func__, "Can't allocate send state");
+            fclose(file);
+            return HTTPD_CGI_DONE;
+        }
+        state->file = file;
+        state->content = NULL;
+        state->remaining = LONG_MAX;
+        state->part = 0;
+        state->rangeCount = 0;
+        state->size = info.size;
+
+        // Offsets into gzip data mean nothing to the client, those files are only sent whole
+        if (hasRange && !info.isGzip) {
+            char etag[24];
+            state->rangeCount = httpdGetRanges(connData, info.size, vfsEtag(etag, sizeof(etag), info.mtime, info.size),
+                                               info.mtime, state->ranges, VFS_MAX_RANGES);
+        }
+        if (state->rangeCount < 0) {
+            char contentRange[32];
+            snprintf(contentRange, sizeof(contentRange), "bytes */%ld", info.size);
+            httpdStartResponse(connData, 416);
+            httpdHeader(connData, "Content-Range", contentRange);
+            httpdEndHeaders(connData);
+            vfsSendFree(state);
+            ESP_LOGD(__func__, "fclose: %s, unsatisfiable range", info.path);
+            return HTTPD_CGI_DONE;
+        }
+
+        int responseStart = connData->priv.sendBuffLen;
+        httpdStartResponse(connData, state->rangeCount > 0 ? 206 : 200);
+        // The headers that only depend on the file and the route come first, so they can be
+        // cached together with the contents
+        int headersStart = connData->priv.sendBuffLen;
 
         const char *mimetype = NULL;
         bool sendContentType = false;
-        bool sentHeaders = false;
+        bool hasHeaderCb = false;
 
         if (connData->cgiArg == &httpdCgiEx) {
             HttpdCgiExArg *ex = (HttpdCgiExArg *)connData->cgiArg2;
+            hasHeaderCb = (ex->headerCb != NULL);
             if (ex->mimetype) {
                 mimetype = ex->mimetype;
                 sendContentType = true;
@@ -180,46 +922,112 @@ CgiStatus MEM_ATTR cgiEspVfsGet(HttpdConnData *connData) {
 
         if (sendContentType) {
             if (!mimetype) {
-                mimetype = isIndex ? httpdGetMimetype("index.html") : httpdGetMimetype(connData->url);
+                mimetype = info.mimetype;
+            }
+            if (state->rangeCount < 2) {
+                httpdHeader(connData, "Content-Type", mimetype);
             }
-            httpdHeader(connData, "Content-Type", mimetype);
         }
 
-        if (isGzip) {
+        if (info.isGzip) {
             httpdHeader(connData, "Content-Encoding", "gzip");
+        } else {
+            httpdHeader(connData, "Accept-Ranges", "bytes");
         }
 
-        if (connData->cgiArg == &httpdCgiEx) {
-            HttpdCgiExArg *ex = (HttpdCgiExArg *)connData->cgiArg2;
-            if (ex->headerCb) {
-                ex->headerCb(connData);
-                sentHeaders = true;
+        vfsValidatorHeaders(connData, info.mtime, info.size);
+        if (mimetype && !hasHeaderCb) {
+            httpdAddCacheHeaders(connData, mimetype);
+        }
+
+        if (state->rangeCount == 0) {
+            content = vfsContentInsert(connData, hash, &info, file, &connData->priv.sendBuff[headersStart],
+                                       connData->priv.sendBuffLen - headersStart);
+            if (content != NULL) {
+                // read in whole, answer from the cache like a hit
+                vfsSendFree(state);
+                ESP_LOGD(__func__, "fclose: %s, cached", info.path);
+                connData->priv.sendBuffLen = responseStart;
+                return vfsContentServe(connData, content);
             }
+        } else if (state->rangeCount == 1) {
+            char contentRange[64];
+            snprintf(contentRange, sizeof(contentRange), "bytes %ld-%ld/%ld",
+                     state->ranges[0].start, state->ranges[0].end, info.size);
+            httpdHeader(connData, "Content-Range", contentRange);
+            fseek(file, state->ranges[0].start, SEEK_SET);
+            state->remaining = state->ranges[0].end - state->ranges[0].start + 1;
+            state->part = 1;
+        } else {
+            char contentType[64];
+            snprintf(state->boundary, sizeof(state->boundary), "esphttpd%08x%08lx",
+                     (unsigned int)hash, (unsigned long)info.mtime);
+            snprintf(contentType, sizeof(contentType), "multipart/byteranges; boundary=%s", state->boundary);
+            httpdHeader(connData, "Content-Type", contentType);
+            state->mimetype = mimetype ? mimetype : info.mimetype;
+            state->remaining = 0;
         }
 
-        if (mimetype && !sentHeaders) {
-            httpdAddCacheHeaders(connData, mimetype);
+        connData->cgiData=state;
+        if (hasHeaderCb) {
+            ((HttpdCgiExArg *)connData->cgiArg2)->headerCb(connData);
         }
         httpdEndHeaders(connData);
         return HTTPD_CGI_MORE;
     }
 
-    len = fread(buff, 1, FILE_CHUNK_LEN, file);
-    if (len > 0) httpdSend(connData, buff, len);
-    if (len != FILE_CHUNK_LEN) {
-        // We're done.
-        fclose(file);
-        ESP_LOGD(__func__, "fclose: %s, r", filename);
+    if (state->content) {
+        return vfsContentSend(connData, state);
+    }
 
-        return HTTPD_CGI_DONE;
-    } else {
-        // Ok, till next time.
+    while (state->remaining == 0) {
+        // Current range is done: on to the next part, or the end
+        if (state->rangeCount < 2 || state->part > state->rangeCount) {
+            vfsSendFree(state);
+            ESP_LOGD(__func__, "fclose: %s", connData->url);
+            return HTTPD_CGI_DONE;
+        }
+        if (!vfsSendPartHeader(connData, state)) {
+            return HTTPD_CGI_MORE;
+        }
+        if (state->part < state->rangeCount) {
+            const HttpdRange *r = &state->ranges[state->part];
+            fseek(state->file, r->start, SEEK_SET);
+            state->remaining = r->end - r->start + 1;
+        }
+        state->part++;
+    }
+
+    // Read straight into the send buffer, as much as it takes
+    int room;
+    char *buff = httpdSendReserve(connData, &room);
+    if (buff == NULL) {
         return HTTPD_CGI_MORE;
     }
+    if (room > state->remaining) {
+        room = state->remaining;
+    }
+    len = fread(buff, 1, room, state->file);
+    httpdSendCommit(connData, len);
+    if (len != room) {
+        // We're done, or the file got shorter under us
+        vfsSendFree(state);
+        ESP_LOGD(__func__, "fclose: %s", connData->url);
+
+        return HTTPD_CGI_DONE;
+    }
+    if (state->remaining != LONG_MAX) {
+        state->remaining -= len;
+    }
+    // Ok, till next time.
+    return HTTPD_CGI_MORE;
 }
 
 typedef struct {
-    FILE *file;
+    FILE *file;             // when streaming a template that isn't cached
+    TplCompiled *tpl;       // else
+    int segment;            // being rendered
+    uint32_t litPos;        // sent of its literal
     void *tplArg;
     char token[64];
     int tokenPos;
@@ -227,29 +1035,112 @@ typedef struct {
 
 typedef void (* TplCallback)(HttpdConnData *connData, char *token, void **arg);
 
-CgiStatus cgiEspVfsTemplate(HttpdConnData *connData) {
-    TplData *tpd = connData->cgiData;
+//Room a token's replacement can count on; rendering stops for this call when less is left
+#define TPL_TOKEN_ROOM 256
+
+//Render the next part of a compiled template. Returns true when all of it has been sent.
+static bool MEM_ATTR tplRender(HttpdConnData *connData, TplData *tpd) {
+    TplCompiled *tpl = tpd->tpl;
+    while (tpd->segment < tpl->segmentCount) {
+        TplSegment *seg = &tpl->segments[tpd->segment];
+        if (tpd->litPos < seg->litLen) {
+            // literal runs go out in bulk, straight into the send buffer
+            int room;
+            char *buff = httpdSendReserve(connData, &room);
+            int len = seg->litLen - tpd->litPos;
+            if (len > room) len = room;
+            if (buff != NULL) memcpy(buff, &tpl->text[seg->litOffset + tpd->litPos], len);
+            httpdSendCommit(connData, len);
+            tpd->litPos += len;
+            if (tpd->litPos < seg->litLen) return false;
+        }
+        if (seg->tokenOffset >= 0) {
+            int room;
+            httpdSendReserve(connData, &room);
+            httpdSendCommit(connData, 0);
+            if (room < TPL_TOKEN_ROOM) return false;
+            strlcpy(tpd->token, &tpl->text[seg->tokenOffset], sizeof(tpd->token));
+            ((TplCallback)(connData->cgiArg))(connData, tpd->token, &tpd->tplArg);
+        }
+        tpd->segment++;
+        tpd->litPos = 0;
+    }
+    return true;
+}
+
+//Scan and send the next chunk of a template streamed from its file. Returns true at the end.
+static bool MEM_ATTR tplStream(HttpdConnData *connData, TplData *tpd) {
     int len;
     int x, sp = 0;
     char *e = NULL;
     char buff[FILE_CHUNK_LEN +1];
-    char filename[MAX_FILENAME_LENGTH + 1];
 
+    len = fread(buff, 1, FILE_CHUNK_LEN, tpd->file);
+    if (len > 0) {
+        sp = 0;
+        e = buff;
+        for ( x = 0; x < len; ++x) {
+            if (tpd->tokenPos == -1) {
+                //Inside ordinary text.
+                if (buff[x] == '%') {
+                    //Send raw data up to now
+                    if (sp != 0) httpdSend(connData, e, sp);
+                    sp = 0;
+                    //Go collect token chars.
+                    tpd->tokenPos = 0;
+                } else {
+                    sp++;
+                }
+            } else {
+                if (buff[x] == '%') {
+                    if (tpd->tokenPos == 0) {
+                        // This is the second % of a %% escape string.
+                        // Send a single % and resume with the normal program flow.
+                        httpdSend(connData, "%", 1);
+                    } else {
+                        // This is an actual token.
+                        tpd->token[tpd->tokenPos++] = 0; // zero-terminate token
+                        ((TplCallback)(connData->cgiArg))(connData, tpd->token, &tpd->tplArg);
+                    }
+                    // Go collect normal chars again.
+                    e = &buff[x+1];
+                    tpd->tokenPos = -1;
+                } else {
+                    if (tpd->tokenPos<(sizeof(tpd->token)-1)) tpd->token[tpd->tokenPos++]=buff[x];
+                }
+            }
+        }
+    }
+    //Send remaining bit.
+    if (sp != 0) httpdSend(connData, e, sp);
+    return (len != FILE_CHUNK_LEN);
+}
+
+static void MEM_ATTR tplFree(TplData *tpd) {
+    if (tpd->file != NULL) {
+        fclose(tpd->file);
+    }
+    if (tpd->tpl != NULL) {
+        tplPut(tpd->tpl);
+    }
+    free(tpd);
+}
+
+CgiStatus cgiEspVfsTemplate(HttpdConnData *connData) {
+    TplData *tpd = connData->cgiData;
+    bool done;
 
     if (connData->isConnectionClosed) {
         //Connection aborted. Clean up.
         ((TplCallback)(connData->cgiArg))(connData, NULL, &tpd->tplArg);
-        if(tpd->file != NULL){
-            fclose(tpd->file);
-        }
-        free(tpd);
+        tplFree(tpd);
         return HTTPD_CGI_DONE;
     }
 
     if (tpd == NULL) {
         //First call to this cgi. Open the file so we can read it.
         struct stat s;
-        if (stat(filename, &s) != 0 || S_ISDIR(s.st_mode)) {
+        if (stat(connData->url, &s) != 0 || S_ISDIR(s.st_mode)) {
             return HTTPD_CGI_NOTFOUND;
         }
 
@@ -258,17 +1149,18 @@ CgiStatus cgiEspVfsTemplate(HttpdConnData *connData) {
             return HTTPD_CGI_NOTFOUND;
         }
 
-        getFilepath(connData, filename, sizeof(filename));
-
         tpd = (TplData *)malloc(sizeof(TplData));
         if (tpd == NULL) return HTTPD_CGI_NOTFOUND;
-        tpd->file = fopen(connData->url, "r");
-        tpd->tplArg = NULL;
+        memset(tpd, 0, sizeof(TplData));
         tpd->tokenPos = -1;
-        if (tpd->file == NULL) {
-            fclose(tpd->file);
-            free(tpd);
-            return HTTPD_CGI_NOTFOUND;
+        // Parsed once and kept while the file doesn't change; too big ones are scanned as they're sent
+        tpd->tpl = tplCacheGet(connData->url, &s);
+        if (tpd->tpl == NULL) {
+            tpd->file = fopen(connData->url, "r");
+            if (tpd->file == NULL) {
+                free(tpd);
+                return HTTPD_CGI_NOTFOUND;
+            }
         }
 
         connData->cgiData = tpd;
@@ -306,49 +1198,11 @@ CgiStatus cgiEspVfsTemplate(HttpdConnData *connData) {
         return HTTPD_CGI_MORE;
     }
 
-    len = fread(buff, 1, FILE_CHUNK_LEN, tpd->file);
-    if (len > 0) {
-        sp = 0;
-        e = buff;
-        for ( x = 0; x < len; ++x) {
-            if (tpd->tokenPos == -1) {
-                //Inside ordinary text.
-                if (buff[x] == '%') {
-                    //Send raw data up to now
-                    if (sp != 0) httpdSend(connData, e, sp);
-                    sp = 0;
-                    //Go collect token chars.
-                    tpd->tokenPos = 0;
-                } else {
-                    sp++;
-                }
-            } else {
-                if (buff[x] == '%') {
-                    if (tpd->tokenPos == 0) {
-                        // This is the second % of a %% escape string.
-                        // Send a single % and resume with the normal program flow.
-                        httpdSend(connData, "%", 1);
-                    } else {
-                        // This is an actual token.
-                        tpd->token[tpd->tokenPos++] = 0; // zero-terminate token
-                        ((TplCallback)(connData->cgiArg))(connData, tpd->token, &tpd->tplArg);
-                    }
-                    // Go collect normal chars again.
-                    e = &buff[x+1];
-                    tpd->tokenPos = -1;
-                } else {
-                    if (tpd->tokenPos<(sizeof(tpd->token)-1)) tpd->token[tpd->tokenPos++]=buff[x];
-                }
-            }
-        }
-    }
-    //Send remaining bit.
-    if (sp != 0) httpdSend(connData, e, sp);
-    if (len != FILE_CHUNK_LEN) {
+    done = (tpd->tpl != NULL) ? tplRender(connData, tpd) : tplStream(connData, tpd);
+    if (done) {
         //We're done.
         ((TplCallback)(connData->cgiArg))(connData, NULL, &tpd->tplArg);
-        fclose(tpd->file);
-        free(tpd);
+        tplFree(tpd);
         return HTTPD_CGI_DONE;
     } else {
         //Ok, till next time.
@@ -428,6 +1282,8 @@ CgiStatus cgiEspVfsUpload(HttpdConnData *connData) {
             if(state->file != NULL){
                 fclose(state->file);
                 ESP_LOGD(__func__, "fclose: %s, r", state->filename);
+                // the partial file stays behind, a GET during the upload may have cached its size
+                cgiEspVfsCacheInvalidate(state->filename);
             }
             free(state);
         }
@@ -524,6 +1380,8 @@ CgiStatus cgiEspVfsUpload(HttpdConnData *connData) {
 
         state->state=UPSTATE_WRITE;
         ESP_LOGD(__func__, "fopen: %s, w", state->filename);
+        // Cached lookups of this file, its .gz variant or what is below it are stale now
+        cgiEspVfsCacheInvalidate(state->filename);
 
 error_first:
         connData->cgiData=state;
@@ -556,6 +1414,8 @@ error_first:
         if(state->file != NULL){
             fclose(state->file);
             ESP_LOGD(__func__, "fclose: %s, r", state->filename);
+            // a GET during the upload may have cached the size of the partial file
+            cgiEspVfsCacheInvalidate(state->filename);
         }
         ESP_LOGI(__func__, "Total: %d bytes written.", state->b_written);
 
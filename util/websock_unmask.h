@@ -0,0 +1,51 @@
+#ifndef __WEBSOCK_UNMASK_H__
+#define __WEBSOCK_UNMASK_H__
+
+/*
+Websocket payload unmasking, kept apart from cgiwebsocket.c so the host tests in test/host can build it.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef MEM_ATTR
+#define MEM_ATTR
+#endif
+
+//Unmask payload bytes in place, continuing at mask position *maskCtr. Works a machine word at a time
+//once data is aligned, using the mask rotated to the current position; word sizes are a multiple of the
+//4 byte mask so every word uses the same rotated mask.
+static void MEM_ATTR websockUnmask(char *data, int len, const uint8_t *mask, uint8_t *maskCtr) {
+    uint8_t *p = (uint8_t *)data;
+    uint8_t ctr = *maskCtr;
+
+    while (len > 0 && ((uintptr_t)p & (sizeof(size_t) - 1))) {
+        *p++ ^= mask[(ctr++)&3];
+        len--;
+    }
+
+    if (len >= (int)sizeof(size_t)) {
+        uint8_t rotated[sizeof(size_t)];
+        size_t wordMask, word;
+        for (int i = 0; i < (int)sizeof(size_t); i++) rotated[i] = mask[(ctr + i)&3];
+        memcpy(&wordMask, rotated, sizeof(wordMask));
+
+        // p is aligned, the memcpy()s compile to plain word loads and stores
+        uint8_t *end = p + (len & ~(int)(sizeof(size_t) - 1));
+        len -= end - p;
+        ctr += end - p;
+        for (; p < end; p += sizeof(size_t)) {
+            memcpy(&word, p, sizeof(word));
+            word ^= wordMask;
+            memcpy(p, &word, sizeof(word));
+        }
+    }
+
+    while (len > 0) {
+        *p++ ^= mask[(ctr++)&3];
+        len--;
+    }
+    *maskCtr = ctr;
+}
+
+#endif